@@ -1,43 +1,95 @@
 #include "AABB.h"
 
-AABB::AABB(const Vector3f& min, const Vector3f& max)
-    : m_Min(min), m_Max(max)
-{
-}
+#include <chrono>
+#include <random>
+#include <vector>
+#include <iostream>
 
-bool AABB::isHit(const Ray& ray, float maxT, float& currMaxT) const
+namespace
 {
-    float t0 = std::numeric_limits<float>::min();
-    float t1 = std::numeric_limits<float>::max();
-
-    for (int axis = 0; axis < 3; axis++) 
+    // Slab tests as they were before rays carried their reciprocal direction,
+    // kept as the baseline of AABB::benchmarkSlabTests
+    bool divisionIsHit(const AABB& aabb, const Ray& ray, float maxT, float& currMaxT)
     {
-        float currMin, currMax;
-        if (ray.direction()[axis] >= 0) 
-        {
-            currMax = (m_Max[axis] - ray.origin()[axis]) / ray.direction()[axis];
-            if (currMax < 0.0f)
-                return false;
+        float t0 = std::numeric_limits<float>::min();
+        float t1 = std::numeric_limits<float>::max();
 
-            currMin = (m_Min[axis] - ray.origin()[axis]) / ray.direction()[axis];
-        }
-        else
+        for (int axis = 0; axis < 3; axis++)
         {
-            currMax = (m_Min[axis] - ray.origin()[axis]) / ray.direction()[axis];
-            if (currMax < 0.0f)
+            float currMin, currMax;
+            if (ray.direction()[axis] >= 0)
+            {
+                currMax = (aabb.max()[axis] - ray.origin()[axis]) / ray.direction()[axis];
+                if (currMax < 0.0f)
+                    return false;
+
+                currMin = (aabb.min()[axis] - ray.origin()[axis]) / ray.direction()[axis];
+            }
+            else
+            {
+                currMax = (aabb.min()[axis] - ray.origin()[axis]) / ray.direction()[axis];
+                if (currMax < 0.0f)
+                    return false;
+
+                currMin = (aabb.max()[axis] - ray.origin()[axis]) / ray.direction()[axis];
+            }
+
+            if (t0 > currMax || t1 < currMin)
                 return false;
 
-            currMin = (m_Max[axis] - ray.origin()[axis]) / ray.direction()[axis];
+            t0 = std::max(t0, currMin);
+            t1 = std::min(t1, currMax);
         }
 
-        if (t0 > currMax || t1 < currMin)
+        if (t1 > maxT)
             return false;
 
-        t0 = std::max(t0, currMin);
-        t1 = std::min(t1, currMax);
+        currMaxT = t1 + 0.001f;
+        return true;
+    }
+
+    bool divisionEntryDistance(const AABB& aabb, const Ray& ray, float maxT, float& entryT)
+    {
+        float t0 = 0.0f;
+        float t1 = maxT;
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float invDirection = 1.0f / ray.direction()[axis];
+            float tNear = (aabb.min()[axis] - ray.origin()[axis]) * invDirection;
+            float tFar = (aabb.max()[axis] - ray.origin()[axis]) * invDirection;
+
+            if (invDirection < 0.0f)
+                std::swap(tNear, tFar);
+
+            t0 = tNear > t0 ? tNear : t0;
+            t1 = tFar < t1 ? tFar : t1;
+
+            if (t0 > t1)
+                return false;
+        }
+
+        entryT = t0;
+        return true;
     }
+}
+
+AABB::AABB()
+    : m_Min(Vector3f( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max())),
+      m_Max(Vector3f(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max()))
+{
+}
+
+AABB::AABB(const Vector3f& min, const Vector3f& max)
+    : m_Min(min), m_Max(max)
+{
+}
 
-    if (t1 > maxT)
+bool AABB::isHit(const Ray& ray, float maxT, float& currMaxT) const
+{
+    float t0 = 0.0f;
+    float t1 = std::numeric_limits<float>::max();
+    if (!clipRay(ray, t0, t1) || t1 > maxT)
         return false;
 
     constexpr float bias = 0.001f;
@@ -46,6 +98,42 @@ bool AABB::isHit(const Ray& ray, float maxT, float& currMaxT) const
     return true;
 }
 
+bool AABB::entryDistance(const Ray& ray, float maxT, float& entryT) const
+{
+    float t0 = 0.0f;
+    float t1 = maxT;
+    if (!clipRay(ray, t0, t1))
+        return false;
+
+    entryT = t0;
+    return true;
+}
+
+// Branchless slab test. The ray's reciprocal direction is always finite, so
+// the distances are never NaN and min/max pick the near and far plane
+// without looking at the direction's sign.
+bool AABB::clipRay(const Ray& ray, float& t0, float& t1) const
+{
+    const Vector3f& invDirection = ray.invDirection();
+    const Vector3f& originInvDirection = ray.originInvDirection();
+
+    // Kept in locals, writes through the references could alias the box
+    float entryT = t0;
+    float exitT = t1;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float tLower = m_Min[axis] * invDirection[axis] - originInvDirection[axis];
+        const float tUpper = m_Max[axis] * invDirection[axis] - originInvDirection[axis];
+
+        entryT = std::max(entryT, std::min(tLower, tUpper));
+        exitT = std::min(exitT, std::max(tLower, tUpper));
+    }
+
+    t0 = entryT;
+    t1 = exitT;
+    return entryT <= exitT;
+}
+
 Vector3f& AABB::min()
 {
     return m_Min;
@@ -66,6 +154,20 @@ const Vector3f& AABB::max() const
     return m_Max;
 }
 
+Point3f AABB::centroid() const
+{
+    return (m_Min + m_Max) * 0.5f;
+}
+
+float AABB::surfaceArea() const
+{
+    const Vector3f extent = m_Max - m_Min;
+    if (extent.x() < 0.0f || extent.y() < 0.0f || extent.z() < 0.0f)
+        return 0.0f;
+
+    return 2.0f * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+}
+
 void AABB::combine(const AABB& other)
 {
     for (int axis = 0; axis < 3; axis++)
@@ -75,6 +177,15 @@ void AABB::combine(const AABB& other)
     }
 }
 
+void AABB::combine(const Point3f& point)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        m_Min[axis] = std::min(point[axis], m_Min[axis]);
+        m_Max[axis] = std::max(point[axis], m_Max[axis]);
+    }
+}
+
 bool AABB::intersects(const AABB& other) const
 {
     for (int axis = 0; axis < 3; axis++)
@@ -87,6 +198,29 @@ bool AABB::intersects(const AABB& other) const
     return true;
 }
 
+AABB AABB::intersection(const AABB& other) const
+{
+    AABB result;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        result.m_Min[axis] = std::max(m_Min[axis], other.min()[axis]);
+        result.m_Max[axis] = std::min(m_Max[axis], other.max()[axis]);
+    }
+
+    return result;
+}
+
+bool AABB::isEmpty() const
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (m_Min[axis] > m_Max[axis])
+            return true;
+    }
+
+    return false;
+}
+
 BoxPair AABB::split(unsigned axis) const
 {
     assert(axis >= 0 && axis <= 2);
@@ -100,3 +234,74 @@ BoxPair AABB::split(unsigned axis) const
 
     return { AABB(m_Min, maxBound), AABB(minBound, m_Max) };
 }
+
+// Every ray is tested against every box, each test is run a few times and
+// the fastest pass counts. The rays start on a sphere around a cloud of
+// boxes and aim at random points inside it.
+void AABB::benchmarkSlabTests(unsigned rayCount, unsigned boxCount)
+{
+    constexpr int passCount = 5;
+
+    std::mt19937 random(rayCount * 31 + boxCount);
+    std::uniform_real_distribution<float> position(-10.0f, 10.0f);
+    std::uniform_real_distribution<float> size(0.5f, 4.0f);
+    std::normal_distribution<float> direction;
+
+    std::vector<AABB> boxes;
+    boxes.reserve(boxCount);
+    for (unsigned i = 0; i < boxCount; i++)
+    {
+        const Vector3f min(position(random), position(random), position(random));
+        boxes.emplace_back(min, min + Vector3f(size(random), size(random), size(random)));
+    }
+
+    std::vector<Ray> rays;
+    rays.reserve(rayCount);
+    for (unsigned i = 0; i < rayCount; i++)
+    {
+        const Point3f origin = toUnitVector(Vector3f(direction(random), direction(random), direction(random))) * 20.0f;
+        const Point3f target(position(random), position(random), position(random));
+        rays.emplace_back(origin, toUnitVector(target - origin));
+    }
+
+    const float maxT = 30.0f;
+    const double testCount = double(rayCount) * boxCount;
+
+    // Sums the distances as well as the hits, so no test can be optimized away
+    unsigned hits = 0;
+    double distanceSum = 0.0;
+    const auto measure = [&](const char* name, const auto& test) {
+        double bestSeconds = std::numeric_limits<double>::max();
+        for (int pass = 0; pass < passCount; pass++)
+        {
+            hits = 0;
+            distanceSum = 0.0;
+
+            const auto start = std::chrono::steady_clock::now();
+            for (const Ray& ray : rays)
+            {
+                for (const AABB& box : boxes)
+                {
+                    float t = 0.0f;
+                    if (test(box, ray, maxT, t))
+                    {
+                        hits++;
+                        distanceSum += t;
+                    }
+                }
+            }
+
+            bestSeconds = std::min(bestSeconds, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        std::cout << name << ": " << bestSeconds / testCount * 1e9 << " ns per test, "
+            << hits / testCount * 100.0 << "% hits, distance sum " << distanceSum << "\n";
+    };
+
+    std::cout << "Slab tests, " << rayCount << " rays x " << boxCount << " boxes:\n";
+    measure("isHit (division)", [](const AABB& box, const Ray& ray, float maxT, float& t) { return divisionIsHit(box, ray, maxT, t); });
+    measure("isHit", [](const AABB& box, const Ray& ray, float maxT, float& t) { return box.isHit(ray, maxT, t); });
+    measure("entryDistance (division)", [](const AABB& box, const Ray& ray, float maxT, float& t) { return divisionEntryDistance(box, ray, maxT, t); });
+    measure("entryDistance", [](const AABB& box, const Ray& ray, float maxT, float& t) { return box.entryDistance(ray, maxT, t); });
+    std::cout << std::endl;
+}
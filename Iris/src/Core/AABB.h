@@ -10,18 +10,35 @@ struct BoxPair;
 class AABB
 {
 public:
+	/// Creates an empty (inverted) box, combining it with any other box yields that box
+	AABB();
 	AABB(const Vector3f& min, const Vector3f& max);
 	bool isHit(const Ray& ray, float maxT, float& currMaxT) const;
+	/// Finds where the ray enters the box. Fails if the box is behind the ray or is entered after maxT
+	bool entryDistance(const Ray& ray, float maxT, float& entryT) const;
+	/// Narrows [t0, t1] to the part of the ray inside the box, fails if nothing is left
+	bool clipRay(const Ray& ray, float& t0, float& t1) const;
 
 	Vector3f& min();
 	Vector3f& max();
 	const Vector3f& min() const;
 	const Vector3f& max() const;
 
+	Point3f centroid() const;
+	float surfaceArea() const;
+
 	void combine(const AABB& other);
+	void combine(const Point3f& point);
 	bool intersects(const AABB& other) const;
+	/// The box shared by both, empty if they do not overlap
+	AABB intersection(const AABB& other) const;
+	bool isEmpty() const;
 	BoxPair split(unsigned axis) const;
 
+	/// Times the slab tests, and the division based ones they replaced, over random rays and boxes and prints
+	/// the time per test. Matching hit counts and distance sums show both agree
+	static void benchmarkSlabTests(unsigned rayCount = 1024, unsigned boxCount = 1024);
+
 private:
 	Vector3f m_Min;
 	Vector3f m_Max;
@@ -0,0 +1,1028 @@
+#include "BVH.h"
+
+#include <Core/ThreadPool.h>
+
+#include <mutex>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace
+{
+	// Spreads the lower 10 bits of value so there are two zero bits between each of them
+	uint32_t expandBits(uint32_t value)
+	{
+		value = (value * 0x00010001u) & 0xFF0000FFu;
+		value = (value * 0x00000101u) & 0x0F00F00Fu;
+		value = (value * 0x00000011u) & 0xC30C30C3u;
+		value = (value * 0x00000005u) & 0x49249249u;
+		return value;
+	}
+
+	// 30 bit code interleaving 10 bits of every axis of a point inside the unit cube
+	uint32_t mortonCode(float x, float y, float z)
+	{
+		const auto quantize = [](float value) {
+			return static_cast<uint32_t>(std::min(std::max(value * 1024.0f, 0.0f), 1023.0f));
+		};
+
+		return (expandBits(quantize(x)) << 2) | (expandBits(quantize(y)) << 1) | expandBits(quantize(z));
+	}
+
+	// Stable LSD radix sort on the upper 32 bits of every key, 8 bits per pass.
+	// Chunks are counted and scattered in parallel, every chunk writes its
+	// digits to offsets reserved after those of the previous chunks.
+	void radixSort(std::vector<uint64_t>& keys)
+	{
+		constexpr size_t chunkSize = 16384;
+		constexpr int digitCount = 256;
+
+		const size_t chunkCount = (keys.size() + chunkSize - 1) / chunkSize;
+		std::vector<uint64_t> buffer(keys.size());
+		std::vector<size_t> offsets(chunkCount * digitCount);
+
+		for (int shift = 32; shift < 64; shift += 8)
+		{
+			std::fill(offsets.begin(), offsets.end(), 0);
+
+			parallelFor(keys.size(), chunkSize, [&](size_t begin, size_t end) {
+				size_t* counts = &offsets[begin / chunkSize * digitCount];
+				for (size_t i = begin; i < end; i++)
+					counts[(keys[i] >> shift) & 0xFF]++;
+			});
+
+			size_t offset = 0;
+			for (int digit = 0; digit < digitCount; digit++)
+			{
+				for (size_t chunk = 0; chunk < chunkCount; chunk++)
+				{
+					const size_t count = offsets[chunk * digitCount + digit];
+					offsets[chunk * digitCount + digit] = offset;
+					offset += count;
+				}
+			}
+
+			parallelFor(keys.size(), chunkSize, [&](size_t begin, size_t end) {
+				size_t* chunkOffsets = &offsets[begin / chunkSize * digitCount];
+				for (size_t i = begin; i < end; i++)
+					buffer[chunkOffsets[(keys[i] >> shift) & 0xFF]++] = keys[i];
+			});
+
+			keys.swap(buffer);
+		}
+	}
+
+	// Number of leading zero bits, 64 for zero
+	int leadingZeros(uint64_t value)
+	{
+		if (value == 0)
+			return 64;
+
+#if defined(_MSC_VER)
+		unsigned long index;
+		const uint32_t high = static_cast<uint32_t>(value >> 32);
+		if (high != 0)
+		{
+			_BitScanReverse(&index, high);
+			return 31 - static_cast<int>(index);
+		}
+
+		_BitScanReverse(&index, static_cast<uint32_t>(value));
+		return 63 - static_cast<int>(index);
+#else
+		return __builtin_clzll(value);
+#endif
+	}
+
+	// Binary radix tree over the sorted keys (Karras 2012). Interior node i
+	// covers a range of keys that starts or ends at key i, its extent and split
+	// are found by binary searches over the common prefixes of key i with its
+	// neighbours, without looking at any other node. All nodes are therefore
+	// built in parallel. Keys are unique, so equal Morton codes are told apart
+	// by their index bits. Returns the split of every node, the last key of its
+	// first child. The node covering a child range is the child's last key for
+	// first children and its first key for second ones.
+	std::vector<unsigned> radixTreeSplits(const std::vector<uint64_t>& keys)
+	{
+		const int64_t keyCount = static_cast<int64_t>(keys.size());
+		std::vector<unsigned> splits(keys.size() > 0 ? keys.size() - 1 : 0);
+
+		const auto commonPrefix = [&keys, keyCount](int64_t i, int64_t j) {
+			return j < 0 || j >= keyCount ? -1 : leadingZeros(keys[i] ^ keys[j]);
+		};
+
+		parallelFor(splits.size(), 4096, [&](size_t begin, size_t end) {
+			for (int64_t i = static_cast<int64_t>(begin); i < static_cast<int64_t>(end); i++)
+			{
+				// The range grows towards the neighbour sharing the longer prefix
+				const int64_t direction = commonPrefix(i, i + 1) > commonPrefix(i, i - 1) ? 1 : -1;
+				const int minPrefix = commonPrefix(i, i - direction);
+
+				int64_t maxLength = 2;
+				while (commonPrefix(i, i + maxLength * direction) > minPrefix)
+					maxLength *= 2;
+
+				int64_t length = 0;
+				for (int64_t step = maxLength / 2; step > 0; step /= 2)
+				{
+					if (commonPrefix(i, i + (length + step) * direction) > minPrefix)
+						length += step;
+				}
+
+				const int nodePrefix = commonPrefix(i, i + length * direction);
+
+				int64_t split = 0;
+				int64_t step = length;
+				do
+				{
+					step = (step + 1) / 2;
+					if (commonPrefix(i, i + (split + step) * direction) > nodePrefix)
+						split += step;
+				} while (step > 1);
+
+				splits[i] = static_cast<unsigned>(i + split * direction + std::min<int64_t>(direction, 0));
+			}
+		});
+
+		return splits;
+	}
+}
+
+// Shared by all tasks of one linear build, the keys hold the Morton code in
+// the upper and the primitive index in the lower 32 bits
+struct BVH::LinearBuildContext
+{
+	LinearBuildContext(const std::vector<uint64_t>& keys, const std::vector<AABB>& primitiveAABBs, unsigned maxPrimitivesPerLeaf, unsigned maxDepth, TaskGroup& tasks)
+		: keys(keys), primitiveAABBs(primitiveAABBs), maxPrimitivesPerLeaf(maxPrimitivesPerLeaf), maxDepth(maxDepth), tasks(tasks) {}
+
+	const std::vector<uint64_t>& keys;
+	const std::vector<AABB>& primitiveAABBs;
+	unsigned maxPrimitivesPerLeaf;
+	unsigned maxDepth;
+	TaskGroup& tasks;
+	std::vector<unsigned> splits; // < Of the radix tree's interior nodes
+	std::mutex subtreesMutex;
+	std::vector<std::unique_ptr<BVHBuildTree>> subtrees;
+};
+
+TraversalStats& TraversalStats::operator+=(const TraversalStats& other)
+{
+	rays += other.rays;
+	nodesVisited += other.nodesVisited;
+	primitiveTests += other.primitiveTests;
+	mailboxHits += other.mailboxHits;
+
+	return *this;
+}
+
+TraversalStats& TraversalStats::threadLocal()
+{
+	thread_local TraversalStats stats;
+	return stats;
+}
+
+double BVHStats::duplicationFactor() const
+{
+	return primitiveCount != 0 ? static_cast<double>(referenceCount) / primitiveCount : 0.0;
+}
+
+double BVHStats::averageLeafDepth() const
+{
+	return leafCount != 0 ? static_cast<double>(leafDepthSum) / leafCount : 0.0;
+}
+
+BVHStats& BVHStats::operator+=(const BVHStats& other)
+{
+	nodeCount += other.nodeCount;
+	leafCount += other.leafCount;
+	primitiveCount += other.primitiveCount;
+	referenceCount += other.referenceCount;
+	oversizedLeaves += other.oversizedLeaves;
+	leafDepthSum += other.leafDepthSum;
+	maxDepth = std::max(maxDepth, other.maxDepth);
+	for (unsigned i = 0; i < s_LeafSizeBuckets; i++)
+		leafSizes[i] += other.leafSizes[i];
+	maxSAHCost = std::max(maxSAHCost, other.maxSAHCost);
+	memoryBytes += other.memoryBytes;
+
+	return *this;
+}
+
+std::ostream& operator<<(std::ostream& stream, const BVHStats& stats)
+{
+	stream << "Nodes: " << stats.nodeCount
+		<< " | Leaves: " << stats.leafCount
+		<< " | Depth: max " << stats.maxDepth << ", average leaf " << stats.averageLeafDepth()
+		<< " | Duplication: " << stats.duplicationFactor()
+		<< " | SAH cost (max): " << stats.maxSAHCost
+		<< " | Memory: " << stats.memoryBytes / 1024 << " KiB\n";
+
+	stream << "Leaf sizes:";
+	for (unsigned i = 1; i <= BVHStats::s_LeafSizeBuckets; i++)
+	{
+		if (stats.leafSizes[i - 1] != 0)
+			stream << " " << i << (i == BVHStats::s_LeafSizeBuckets ? "+" : "") << ":" << stats.leafSizes[i - 1];
+	}
+
+	if (stats.oversizedLeaves != 0)
+		stream << " | Oversized leaves: " << stats.oversizedLeaves;
+
+	return stream << "\n";
+}
+
+void BVH::build(const BVHBuildNode* root)
+{
+	clear();
+
+	if (root == nullptr)
+		return;
+
+	std::vector<LinearNode> binaryNodes;
+	flatten(root, binaryNodes);
+
+	if (binaryNodes[0].isLeaf())
+	{
+		// A single leaf still needs a node above it to be referenced from
+		m_Nodes.emplace_back();
+		for (int slot = 0; slot < s_Width; slot++)
+			setChild(m_Nodes[0], slot, AABB(), 0, 0);
+		setChild(m_Nodes[0], 0, binaryNodes[0].aabb, binaryNodes[0].offset, binaryNodes[0].count);
+	}
+	else
+	{
+		collapse(binaryNodes, 0);
+	}
+
+	m_Primitives.resize((m_Primitives.size() + s_Width - 1) / s_Width * s_Width, -1);
+	m_Nodes.shrink_to_fit();
+	m_Primitives.shrink_to_fit();
+}
+
+void BVH::build(const std::vector<AABB>& primitiveAABBs, unsigned maxPrimitivesPerLeaf)
+{
+	assert(maxPrimitivesPerLeaf > 0);
+
+	std::vector<int> primitives(primitiveAABBs.size());
+	for (size_t i = 0; i < primitives.size(); i++)
+		primitives[i] = static_cast<int>(i);
+
+	BVHBuildTree tree;
+	build(buildNode(tree, primitives, primitiveAABBs, maxPrimitivesPerLeaf, 0));
+}
+
+// Children are always stored after their parent, so walking the nodes
+// backwards visits every child before the node that references it. Large
+// trees are refitted a level at a time instead, the nodes of one level do
+// not depend on each other and are spread over the pool.
+void BVH::refit(const std::vector<AABB>& primitiveAABBs)
+{
+	constexpr size_t minParallelNodes = 4096;
+	constexpr size_t chunkSize = 256;
+
+	// Quantized planes are relative to the old bounds, so the tree is refitted at full precision
+	const bool wasQuantized = quantized();
+	if (wasQuantized)
+	{
+		m_Nodes.resize(m_QuantizedNodes.size());
+		for (size_t i = 0; i < m_QuantizedNodes.size(); i++)
+			m_Nodes[i] = dequantizeNode(m_QuantizedNodes[i]);
+		m_QuantizedNodes.clear();
+	}
+
+	if (m_Nodes.size() < minParallelNodes)
+	{
+		for (size_t index = m_Nodes.size(); index-- > 0;)
+			refitNode(m_Nodes[index], primitiveAABBs);
+	}
+	else
+	{
+		std::vector<unsigned> levels(m_Nodes.size(), 0);
+		unsigned levelCount = 1;
+		for (size_t index = 0; index < m_Nodes.size(); index++)
+		{
+			const WideNode& node = m_Nodes[index];
+			for (int slot = 0; slot < s_Width; slot++)
+			{
+				if (node.isEmpty(slot) || node.isLeaf(slot))
+					continue;
+
+				levels[node.child[slot]] = levels[index] + 1;
+				levelCount = std::max(levelCount, levels[index] + 2);
+			}
+		}
+
+		// Node indices sorted by level, levelStart[level] is where a level's nodes begin
+		std::vector<size_t> levelStart(levelCount + 1, 0);
+		for (unsigned level : levels)
+			levelStart[level + 1]++;
+		for (unsigned level = 0; level < levelCount; level++)
+			levelStart[level + 1] += levelStart[level];
+
+		std::vector<size_t> levelEnd(levelStart.begin(), levelStart.end() - 1);
+		std::vector<unsigned> order(m_Nodes.size());
+		for (size_t index = 0; index < m_Nodes.size(); index++)
+			order[levelEnd[levels[index]]++] = static_cast<unsigned>(index);
+
+		for (unsigned level = levelCount; level-- > 0;)
+		{
+			const size_t first = levelStart[level];
+			parallelFor(levelStart[level + 1] - first, chunkSize, [&](size_t begin, size_t end) {
+				for (size_t i = first + begin; i < first + end; i++)
+					refitNode(m_Nodes[order[i]], primitiveAABBs);
+			});
+		}
+	}
+
+	if (wasQuantized)
+		quantize();
+}
+
+// Expects the node's children to be refitted already
+void BVH::refitNode(WideNode& node, const std::vector<AABB>& primitiveAABBs)
+{
+	for (int slot = 0; slot < s_Width; slot++)
+	{
+		if (node.isEmpty(slot))
+			continue;
+
+		AABB aabb;
+		if (node.isLeaf(slot))
+		{
+			for (unsigned i = node.child[slot]; i < node.child[slot] + node.count[slot]; i++)
+				aabb.combine(primitiveAABBs[m_Primitives[i]]);
+		}
+		else
+		{
+			aabb = nodeAABB(m_Nodes[node.child[slot]]);
+		}
+
+		setChild(node, slot, aabb, node.child[slot], node.count[slot]);
+	}
+}
+
+void BVH::buildLinear(const std::vector<AABB>& primitiveAABBs, unsigned maxPrimitivesPerLeaf, unsigned maxDepth)
+{
+	assert(maxPrimitivesPerLeaf > 0 && maxDepth < s_MaxDepth);
+
+	if (primitiveAABBs.empty())
+	{
+		clear();
+		return;
+	}
+
+	AABB centroidBounds;
+	for (const AABB& aabb : primitiveAABBs)
+		centroidBounds.combine(aabb.centroid());
+
+	Vector3f scale;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float extent = centroidBounds.max()[axis] - centroidBounds.min()[axis];
+		scale[axis] = extent > 0.0f ? 1.0f / extent : 0.0f;
+	}
+
+	std::vector<uint64_t> keys(primitiveAABBs.size());
+	parallelFor(keys.size(), 16384, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			const Vector3f offset = primitiveAABBs[i].centroid() - centroidBounds.min();
+			const uint64_t code = mortonCode(offset.x() * scale.x(), offset.y() * scale.y(), offset.z() * scale.z());
+			keys[i] = code << 32 | i;
+		}
+	});
+
+	radixSort(keys);
+
+	BVHBuildTree tree;
+	TaskGroup tasks;
+	LinearBuildContext context(keys, primitiveAABBs, maxPrimitivesPerLeaf, maxDepth, tasks);
+	context.splits = radixTreeSplits(keys);
+
+	BVHBuildNode* root = buildLinearNode(context, tree, 0, 0, keys.size(), 0);
+	tasks.wait();
+
+	for (std::unique_ptr<BVHBuildTree>& subtree : context.subtrees)
+		subtree->transferAllocatedBlocks(tree);
+
+	fitBounds(root);
+	build(root);
+}
+
+void BVH::assign(const WideNode* nodes, size_t nodeCount, const int* primitives, size_t primitiveCount)
+{
+	assert(primitiveCount % s_Width == 0);
+
+	m_QuantizedNodes.clear();
+	m_Nodes.assign(nodes, nodes + nodeCount);
+	m_Primitives.assign(primitives, primitives + primitiveCount);
+}
+
+void BVH::assign(const QuantizedNode* nodes, size_t nodeCount, const int* primitives, size_t primitiveCount)
+{
+	assert(primitiveCount % s_Width == 0);
+
+	m_Nodes.clear();
+	m_QuantizedNodes.assign(nodes, nodes + nodeCount);
+	m_Primitives.assign(primitives, primitives + primitiveCount);
+}
+
+bool BVH::quantize()
+{
+	for (const WideNode& node : m_Nodes)
+	{
+		for (int slot = 0; slot < s_Width; slot++)
+		{
+			if (node.count[slot] > std::numeric_limits<uint16_t>::max())
+				return false;
+		}
+	}
+
+	m_QuantizedNodes.resize(m_Nodes.size());
+	for (size_t i = 0; i < m_Nodes.size(); i++)
+		m_QuantizedNodes[i] = quantizeNode(m_Nodes[i]);
+
+	std::vector<WideNode>().swap(m_Nodes);
+	return true;
+}
+
+void BVH::clear()
+{
+	m_Nodes.clear();
+	m_QuantizedNodes.clear();
+	m_Primitives.clear();
+}
+
+bool BVH::empty() const
+{
+	return m_Nodes.empty() && m_QuantizedNodes.empty();
+}
+
+bool BVH::quantized() const
+{
+	return !m_QuantizedNodes.empty();
+}
+
+// Every entered node costs one unit and every primitive in an entered leaf
+// another, each weighted by the probability of a ray entering the box
+float BVH::sahCost() const
+{
+	return quantized() ? sahCost(m_QuantizedNodes) : sahCost(m_Nodes);
+}
+
+template<typename Node>
+float BVH::sahCost(const std::vector<Node>& nodes)
+{
+	if (nodes.empty())
+		return 0.0f;
+
+	float cost = 0.0f;
+	for (const Node& node : nodes)
+	{
+		cost += nodeAABB(node).surfaceArea();
+
+		for (int slot = 0; slot < s_Width; slot++)
+		{
+			if (!node.isLeaf(slot))
+				continue;
+
+			cost += childAABB(node, slot).surfaceArea() * node.count[slot];
+		}
+	}
+
+	const float rootArea = nodeAABB(nodes[0]).surfaceArea();
+	return rootArea > 0.0f ? cost / rootArea : 0.0f;
+}
+
+BVHStats BVH::stats(unsigned maxPrimitivesPerLeaf) const
+{
+	BVHStats stats;
+	stats.maxSAHCost = sahCost();
+	stats.memoryBytes = m_Nodes.capacity() * sizeof(WideNode) + m_QuantizedNodes.capacity() * sizeof(QuantizedNode) + m_Primitives.capacity() * sizeof(int);
+
+	if (quantized())
+		collectStats(m_QuantizedNodes, maxPrimitivesPerLeaf, stats);
+	else
+		collectStats(m_Nodes, maxPrimitivesPerLeaf, stats);
+
+	return stats;
+}
+
+template<typename Node>
+void BVH::collectStats(const std::vector<Node>& nodes, unsigned maxPrimitivesPerLeaf, BVHStats& stats) const
+{
+	stats.nodeCount = nodes.size();
+	if (nodes.empty())
+		return;
+
+	std::vector<bool> referenced;
+	std::vector<std::pair<int, unsigned>> stack{ { 0, 0 } };
+
+	while (!stack.empty())
+	{
+		const std::pair<int, unsigned> entry = stack.back();
+		stack.pop_back();
+
+		const Node& node = nodes[entry.first];
+		const unsigned childDepth = entry.second + 1;
+
+		for (int slot = 0; slot < s_Width; slot++)
+		{
+			if (node.isEmpty(slot))
+				continue;
+
+			if (!node.isLeaf(slot))
+			{
+				stack.emplace_back(node.child[slot], childDepth);
+				continue;
+			}
+
+			const unsigned count = node.count[slot];
+			stats.leafCount++;
+			stats.referenceCount += count;
+			stats.leafDepthSum += childDepth;
+			stats.maxDepth = std::max(stats.maxDepth, childDepth);
+			stats.leafSizes[std::min(count, BVHStats::s_LeafSizeBuckets) - 1]++;
+			if (count > maxPrimitivesPerLeaf)
+				stats.oversizedLeaves++;
+
+			for (unsigned i = 0; i < count; i++)
+			{
+				const int primitive = m_Primitives[node.child[slot] + i];
+				if (primitive >= static_cast<int>(referenced.size()))
+					referenced.resize(primitive + 1, false);
+
+				stats.primitiveCount += !referenced[primitive];
+				referenced[primitive] = true;
+			}
+		}
+	}
+}
+
+const std::vector<BVH::WideNode>& BVH::nodes() const
+{
+	return m_Nodes;
+}
+
+const std::vector<BVH::QuantizedNode>& BVH::quantizedNodes() const
+{
+	return m_QuantizedNodes;
+}
+
+const std::vector<int>& BVH::primitives() const
+{
+	return m_Primitives;
+}
+
+// Binned SAH: the centroids are sorted into buckets along every axis and
+// each bucket boundary is evaluated as a candidate split plane. The cost of a
+// split is SA(left) * N(left) + SA(right) * N(right), the constant traversal
+// cost and the division by the parent's area do not change the best candidate.
+void BVH::partitionSAH(const std::vector<int>& primitives, const std::vector<AABB>& primitiveAABBs, std::vector<int>& left, std::vector<int>& right)
+{
+	constexpr int binCount = 16;
+	// Large inputs, found near the root of big meshes, are binned and
+	// partitioned in chunks on the thread pool and merged in chunk order,
+	// which gives the same result as a single pass
+	constexpr size_t chunkSize = 16384;
+
+	struct Bin
+	{
+		AABB aabb;
+		unsigned count = 0;
+	};
+
+	const size_t chunkCount = (primitives.size() + chunkSize - 1) / chunkSize;
+
+	std::vector<AABB> chunkCentroidBounds(chunkCount);
+	parallelFor(primitives.size(), chunkSize, [&](size_t begin, size_t end) {
+		AABB& bounds = chunkCentroidBounds[begin / chunkSize];
+		for (size_t i = begin; i < end; i++)
+			bounds.combine(primitiveAABBs[primitives[i]].centroid());
+	});
+
+	AABB centroidBounds;
+	for (const AABB& bounds : chunkCentroidBounds)
+		centroidBounds.combine(bounds);
+
+	const auto findBin = [&centroidBounds](const AABB& primitiveAABB, int axis) {
+		const float extent = centroidBounds.max()[axis] - centroidBounds.min()[axis];
+		const int bin = static_cast<int>(binCount * (primitiveAABB.centroid()[axis] - centroidBounds.min()[axis]) / extent);
+		return std::min(bin, binCount - 1);
+	};
+
+	bool splittable[3];
+	for (int axis = 0; axis < 3; axis++)
+		splittable[axis] = centroidBounds.max()[axis] - centroidBounds.min()[axis] > 0.0f;
+
+	// Every chunk fills binCount bins per axis
+	std::vector<Bin> chunkBins(chunkCount * 3 * binCount);
+	parallelFor(primitives.size(), chunkSize, [&](size_t begin, size_t end) {
+		Bin* bins = &chunkBins[begin / chunkSize * 3 * binCount];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (!splittable[axis])
+				continue;
+
+			for (size_t i = begin; i < end; i++)
+			{
+				const AABB& primitiveAABB = primitiveAABBs[primitives[i]];
+				Bin& bin = bins[axis * binCount + findBin(primitiveAABB, axis)];
+				bin.aabb.combine(primitiveAABB);
+				bin.count++;
+			}
+		}
+	});
+
+	float bestCost = std::numeric_limits<float>::max();
+	int bestAxis = -1;
+	int bestBin = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (!splittable[axis])
+			continue;
+
+		Bin bins[binCount];
+		for (size_t chunk = 0; chunk < chunkCount; chunk++)
+		{
+			for (int i = 0; i < binCount; i++)
+			{
+				const Bin& chunkBin = chunkBins[(chunk * 3 + axis) * binCount + i];
+				bins[i].aabb.combine(chunkBin.aabb);
+				bins[i].count += chunkBin.count;
+			}
+		}
+
+		float rightAreas[binCount - 1];
+		unsigned rightCounts[binCount - 1];
+
+		AABB rightBox;
+		unsigned rightCount = 0;
+		for (int i = binCount - 1; i > 0; i--)
+		{
+			rightBox.combine(bins[i].aabb);
+			rightCount += bins[i].count;
+			rightAreas[i - 1] = rightBox.surfaceArea();
+			rightCounts[i - 1] = rightCount;
+		}
+
+		AABB leftBox;
+		unsigned leftCount = 0;
+		for (int i = 0; i < binCount - 1; i++)
+		{
+			leftBox.combine(bins[i].aabb);
+			leftCount += bins[i].count;
+
+			if (leftCount == 0 || rightCounts[i] == 0)
+				continue;
+
+			const float cost = leftBox.surfaceArea() * leftCount + rightAreas[i] * rightCounts[i];
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
+			}
+		}
+	}
+
+	left.clear();
+	right.clear();
+
+	if (bestAxis == -1)
+	{
+		// All centroids coincide, no plane can separate them so the list is halved
+		const size_t middle = primitives.size() / 2;
+		left.assign(primitives.begin(), primitives.begin() + middle);
+		right.assign(primitives.begin() + middle, primitives.end());
+		return;
+	}
+
+	if (chunkCount <= 1)
+	{
+		left.reserve(primitives.size());
+		right.reserve(primitives.size());
+
+		for (int index : primitives)
+		{
+			if (findBin(primitiveAABBs[index], bestAxis) <= bestBin)
+				left.push_back(index);
+			else
+				right.push_back(index);
+		}
+
+		return;
+	}
+
+	std::vector<std::vector<int>> chunkLeft(chunkCount), chunkRight(chunkCount);
+	parallelFor(primitives.size(), chunkSize, [&](size_t begin, size_t end) {
+		std::vector<int>& chunkLeftIndexes = chunkLeft[begin / chunkSize];
+		std::vector<int>& chunkRightIndexes = chunkRight[begin / chunkSize];
+
+		for (size_t i = begin; i < end; i++)
+		{
+			if (findBin(primitiveAABBs[primitives[i]], bestAxis) <= bestBin)
+				chunkLeftIndexes.push_back(primitives[i]);
+			else
+				chunkRightIndexes.push_back(primitives[i]);
+		}
+	});
+
+	for (size_t chunk = 0; chunk < chunkCount; chunk++)
+	{
+		left.insert(left.end(), chunkLeft[chunk].begin(), chunkLeft[chunk].end());
+		right.insert(right.end(), chunkRight[chunk].begin(), chunkRight[chunk].end());
+	}
+}
+
+// Walks the radix tree from the root and emits it as build nodes, every node
+// is visited once. Subtrees below maxPrimitivesPerLeaf keys or past maxDepth
+// become leaves. Interior boxes are left empty here and filled in by
+// fitBounds once all tasks are done.
+BVHBuildNode* BVH::buildLinearNode(LinearBuildContext& context, BVHBuildTree& tree, unsigned radixNode, size_t begin, size_t end, unsigned depth)
+{
+	constexpr size_t minPrimitivesPerTask = 4096;
+
+	const std::vector<uint64_t>& keys = context.keys;
+
+	if (end - begin <= context.maxPrimitivesPerLeaf || depth >= context.maxDepth)
+	{
+		AABB aabb;
+		std::vector<int> primitives;
+		primitives.reserve(end - begin);
+
+		for (size_t i = begin; i < end; i++)
+		{
+			const int primitive = static_cast<int>(keys[i] & 0xFFFFFFFFu);
+			primitives.push_back(primitive);
+			aabb.combine(context.primitiveAABBs[primitive]);
+		}
+
+		BVHBuildNode* leaf = tree.createNode(aabb);
+		leaf->value = std::move(primitives);
+		return leaf;
+	}
+
+	// First key of the second child, the interior nodes covering the children are the keys around it
+	const size_t split = context.splits[radixNode] + size_t(1);
+	assert(split > begin && split < end);
+
+	BVHBuildNode* node = tree.createNode(AABB());
+
+	if (split - begin >= minPrimitivesPerTask)
+	{
+		BVHBuildTree* subtree;
+		{
+			std::lock_guard<std::mutex> lock(context.subtreesMutex);
+			context.subtrees.emplace_back(std::make_unique<BVHBuildTree>());
+			subtree = context.subtrees.back().get();
+		}
+
+		context.tasks.run([&context, subtree, node, begin, split, depth]() {
+			node->left = buildLinearNode(context, *subtree, static_cast<unsigned>(split - 1), begin, split, depth + 1);
+		});
+	}
+	else
+	{
+		node->left = buildLinearNode(context, tree, static_cast<unsigned>(split - 1), begin, split, depth + 1);
+	}
+
+	node->right = buildLinearNode(context, tree, static_cast<unsigned>(split), split, end, depth + 1);
+
+	return node;
+}
+
+AABB BVH::fitBounds(BVHBuildNode* node)
+{
+	if (!node->value.empty())
+		return node->AABB;
+
+	node->AABB = fitBounds(node->left);
+	node->AABB.combine(fitBounds(node->right));
+	return node->AABB;
+}
+
+BVHBuildNode* BVH::buildNode(BVHBuildTree& tree, std::vector<int>& primitives, const std::vector<AABB>& primitiveAABBs, unsigned maxPrimitivesPerLeaf, unsigned depth)
+{
+	if (primitives.empty())
+		return nullptr;
+
+	AABB aabb;
+	for (int index : primitives)
+		aabb.combine(primitiveAABBs[index]);
+
+	BVHBuildNode* node = tree.createNode(aabb);
+
+	if (primitives.size() <= maxPrimitivesPerLeaf || depth + 1 >= s_MaxDepth)
+	{
+		node->value = std::move(primitives);
+		return node;
+	}
+
+	std::vector<int> left, right;
+	partitionSAH(primitives, primitiveAABBs, left, right);
+
+	node->left = buildNode(tree, left, primitiveAABBs, maxPrimitivesPerLeaf, depth + 1);
+	node->right = buildNode(tree, right, primitiveAABBs, maxPrimitivesPerLeaf, depth + 1);
+
+	return node;
+}
+
+void BVH::flatten(const BVHBuildNode* node, std::vector<LinearNode>& binaryNodes)
+{
+	assert(node != nullptr);
+
+	// An interior node with a single child is replaced by that child
+	if (node->value.empty() && (node->left == nullptr || node->right == nullptr))
+	{
+		flatten(node->left != nullptr ? node->left : node->right, binaryNodes);
+		return;
+	}
+
+	const size_t index = binaryNodes.size();
+	binaryNodes.push_back({ node->AABB, 0, 0 });
+
+	if (!node->value.empty())
+	{
+		m_Primitives.resize((m_Primitives.size() + s_Width - 1) / s_Width * s_Width, -1);
+		binaryNodes[index].offset = static_cast<unsigned>(m_Primitives.size());
+		binaryNodes[index].count = static_cast<unsigned>(node->value.size());
+		m_Primitives.insert(m_Primitives.end(), node->value.begin(), node->value.end());
+		return;
+	}
+
+	flatten(node->left, binaryNodes);
+	binaryNodes[index].offset = static_cast<unsigned>(binaryNodes.size());
+	flatten(node->right, binaryNodes);
+}
+
+// Starting from the two children of a binary node, the interior child with
+// the largest surface area is repeatedly replaced by its own two children
+// until four children are gathered or only leaves are left.
+int BVH::collapse(const std::vector<LinearNode>& binaryNodes, unsigned index)
+{
+	assert(!binaryNodes[index].isLeaf());
+
+	unsigned children[s_Width] = { index + 1, binaryNodes[index].offset };
+	int childCount = 2;
+
+	while (childCount < s_Width)
+	{
+		int largestChild = -1;
+		float largestArea = -1.0f;
+
+		for (int i = 0; i < childCount; i++)
+		{
+			const LinearNode& child = binaryNodes[children[i]];
+			if (!child.isLeaf() && child.aabb.surfaceArea() > largestArea)
+			{
+				largestArea = child.aabb.surfaceArea();
+				largestChild = i;
+			}
+		}
+
+		if (largestChild == -1)
+			break;
+
+		const unsigned opened = children[largestChild];
+		children[largestChild] = opened + 1;
+		children[childCount++] = binaryNodes[opened].offset;
+	}
+
+	const int wideIndex = static_cast<int>(m_Nodes.size());
+	m_Nodes.emplace_back();
+
+	for (int slot = 0; slot < s_Width; slot++)
+		setChild(m_Nodes[wideIndex], slot, AABB(), 0, 0);
+
+	for (int slot = 0; slot < childCount; slot++)
+	{
+		const LinearNode& child = binaryNodes[children[slot]];
+
+		// The recursion grows m_Nodes, so the node is only accessed through its index
+		const int childIndex = child.isLeaf() ? static_cast<int>(child.offset) : collapse(binaryNodes, children[slot]);
+		setChild(m_Nodes[wideIndex], slot, child.aabb, childIndex, child.count);
+	}
+
+	return wideIndex;
+}
+
+template<typename Node>
+AABB BVH::nodeAABB(const Node& node)
+{
+	AABB aabb;
+	for (int slot = 0; slot < s_Width; slot++)
+	{
+		if (!node.isEmpty(slot))
+			aabb.combine(childAABB(node, slot));
+	}
+
+	return aabb;
+}
+
+AABB BVH::childAABB(const WideNode& node, int slot)
+{
+	return AABB(
+		Vector3f(node.lower[0][slot], node.lower[1][slot], node.lower[2][slot]),
+		Vector3f(node.upper[0][slot], node.upper[1][slot], node.upper[2][slot])
+	);
+}
+
+// Every axis gets the smallest power of two scale that spans the node's box
+// in 255 steps. Lower planes are rounded down and upper planes up, and the
+// rounding is checked against the decoded value so it is never inwards.
+BVH::QuantizedNode BVH::quantizeNode(const WideNode& node)
+{
+	const AABB aabb = nodeAABB(node);
+
+	QuantizedNode quantized{};
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float origin = aabb.min()[axis];
+		const float extent = aabb.max()[axis] - origin;
+
+		int exponent = 0;
+		if (extent > 0.0f)
+			std::frexp(extent / 255.0f, &exponent);
+		exponent = std::min(std::max(exponent, -126), 127);
+		while (exponent < 127 && origin + 255.0f * std::ldexp(1.0f, exponent) < aabb.max()[axis])
+			exponent++;
+
+		const float scale = std::ldexp(1.0f, exponent);
+		quantized.origin[axis] = origin;
+		quantized.exponent[axis] = static_cast<int8_t>(exponent);
+
+		for (int slot = 0; slot < s_Width; slot++)
+		{
+			if (node.isEmpty(slot))
+			{
+				quantized.lower[axis][slot] = 255;
+				quantized.upper[axis][slot] = 0;
+				continue;
+			}
+
+			const float lower = node.lower[axis][slot];
+			const float upper = node.upper[axis][slot];
+
+			int lowerStep = std::min(std::max(static_cast<int>(std::floor((lower - origin) / scale)), 0), 255);
+			while (lowerStep > 0 && origin + lowerStep * scale > lower)
+				lowerStep--;
+
+			int upperStep = std::min(std::max(static_cast<int>(std::ceil((upper - origin) / scale)), 0), 255);
+			while (upperStep < 255 && origin + upperStep * scale < upper)
+				upperStep++;
+
+			quantized.lower[axis][slot] = static_cast<uint8_t>(lowerStep);
+			quantized.upper[axis][slot] = static_cast<uint8_t>(upperStep);
+		}
+	}
+
+	for (int slot = 0; slot < s_Width; slot++)
+	{
+		quantized.child[slot] = node.child[slot];
+		quantized.count[slot] = static_cast<uint16_t>(node.count[slot]);
+	}
+
+	return quantized;
+}
+
+BVH::WideNode BVH::dequantizeNode(const QuantizedNode& node)
+{
+	WideNode wideNode;
+	for (int slot = 0; slot < s_Width; slot++)
+		setChild(wideNode, slot, node.isEmpty(slot) ? AABB() : childAABB(node, slot), node.child[slot], node.count[slot]);
+
+	return wideNode;
+}
+
+AABB BVH::childAABB(const QuantizedNode& node, int slot)
+{
+	AABB aabb;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float scale = std::ldexp(1.0f, node.exponent[axis]);
+		aabb.min()[axis] = node.origin[axis] + node.lower[axis][slot] * scale;
+		aabb.max()[axis] = node.origin[axis] + node.upper[axis][slot] * scale;
+	}
+
+	return aabb;
+}
+
+void BVH::setChild(WideNode& node, int slot, const AABB& aabb, int child, unsigned count)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		node.lower[axis][slot] = aabb.min()[axis];
+		node.upper[axis][slot] = aabb.max()[axis];
+	}
+
+	node.child[slot] = child;
+	node.count[slot] = count;
+}
+
+constexpr unsigned BVHStats::s_LeafSizeBuckets;
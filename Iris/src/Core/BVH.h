@@ -0,0 +1,396 @@
+#ifndef BVH_H
+
+#define BVH_H
+
+#include <vector>
+#include <ostream>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <emmintrin.h>
+#include <Core/AABB.h>
+#include <Core/RayPacket.h>
+#include <Core/BoundaryTree.h>
+
+// Pointer based trees are only used while building
+using BVHBuildNode = Node<std::vector<int>>;
+using BVHBuildTree = BoundaryTree<std::vector<int>>;
+
+// Per thread counters filled in by the traversal routines. They are cheap
+// enough to stay enabled and are used for benchmarking acceleration structures.
+struct TraversalStats
+{
+	uint64_t rays = 0;
+	uint64_t nodesVisited = 0;
+	uint64_t primitiveTests = 0;
+	uint64_t mailboxHits = 0;	// Repeated tests of a duplicated primitive that were skipped
+
+	TraversalStats& operator+=(const TraversalStats& other);
+
+	static TraversalStats& threadLocal();
+};
+
+// Shape of a built tree, used to tune the builders from data and to catch
+// degenerate trees before they show up as slow renders. Depths count wide
+// nodes, the root sits at depth zero and its leaves at depth one.
+struct BVHStats
+{
+	static constexpr unsigned s_LeafSizeBuckets = 16; // < Leaves of size 1 to 15, the last bucket holds larger ones
+
+	uint64_t nodeCount = 0;
+	uint64_t leafCount = 0;
+	uint64_t primitiveCount = 0;   // < Distinct primitives
+	uint64_t referenceCount = 0;   // < Primitive references of all leaves, duplicated primitives count once per leaf
+	uint64_t oversizedLeaves = 0;  // < Leaves above the builder's limit, forced by the depth limit or coinciding centroids
+	uint64_t leafDepthSum = 0;
+	unsigned maxDepth = 0;
+	uint64_t leafSizes[s_LeafSizeBuckets] = {};
+	float maxSAHCost = 0.0f;
+	size_t memoryBytes = 0;
+
+	double duplicationFactor() const;
+	double averageLeafDepth() const;
+
+	BVHStats& operator+=(const BVHStats& other);
+};
+
+std::ostream& operator<<(std::ostream& stream, const BVHStats& stats);
+
+// A 4-wide bounding volume hierarchy stored depth-first in a single array.
+// It is built by collapsing a binary tree, every node keeps up to four
+// children whose boxes are laid out per axis (SoA) so a single SSE slab test
+// covers all of them. Leaves reference a range of the shared primitive
+// array instead of owning their own index buffer. Every range starts on a
+// multiple of s_Width and is padded with -1, so primitive data can be
+// mirrored in SIMD blocks of s_Width entries.
+class BVH
+{
+public:
+	static constexpr int s_Width = 4;
+
+	struct WideNode
+	{
+		float lower[3][s_Width]; // < Per axis minimum of every child's box
+		float upper[3][s_Width]; // < Per axis maximum of every child's box
+		int child[s_Width];      // < Interior children: node index, leaves: first primitive
+		unsigned count[s_Width]; // < Primitive count of leaf children, zero for interior children
+
+		bool isLeaf(int slot) const  { return count[slot] != 0; }
+		// The root is never a child, so node index zero marks an unused slot
+		bool isEmpty(int slot) const { return count[slot] == 0 && child[slot] == 0; }
+	};
+
+	// Compressed node of 64 bytes, half the size of a WideNode. Child planes
+	// are stored in 8 bits relative to the node's box, scaled per axis by a
+	// power of two so decoding is exact. Planes are rounded outwards, the
+	// decoded box of a child always contains its real box. Empty slots decode
+	// to inverted boxes (lower = 255, upper = 0).
+	struct QuantizedNode
+	{
+		float origin[3];
+		int8_t exponent[3];
+		uint8_t padding;
+		uint8_t lower[3][s_Width];
+		uint8_t upper[3][s_Width];
+		int child[s_Width];
+		uint16_t count[s_Width];
+
+		bool isLeaf(int slot) const  { return count[slot] != 0; }
+		bool isEmpty(int slot) const { return count[slot] == 0 && child[slot] == 0; }
+	};
+
+	// A traversal stack entry is either a wide node (count == 0) or a leaf's primitive range
+	struct StackEntry
+	{
+		int child;
+		unsigned count;
+		float entryT;
+	};
+
+	// Packets share one stack, mask holds the rays that entered the node
+	struct PacketStackEntry
+	{
+		int child;
+		unsigned count;
+		float entryT; // < Earliest entry of the rays in mask
+		int mask;
+	};
+
+	// Ray data splatted into SSE registers once per traversal
+	struct SIMDRay
+	{
+		SIMDRay(const Ray& ray);
+
+		__m128 origin[3];
+		__m128 direction[3];
+		__m128 invDirection[3];
+		__m128 originInvDirection[3];
+		bool negative[3];
+	};
+
+public:
+	/// Binary trees can not be deeper than this
+	static constexpr unsigned s_MaxDepth = 64;
+	/// Upper bound of the traversal stack, every level pushes at most three children
+	static constexpr unsigned s_MaxStackSize = (s_Width - 1) * s_MaxDepth + 1;
+
+public:
+	void build(const BVHBuildNode* root);
+	/// Builds over the given boxes with binned SAH, leaves reference the boxes' indices
+	void build(const std::vector<AABB>& primitiveAABBs, unsigned maxPrimitivesPerLeaf);
+	/// Builds over the given boxes by sorting their centroids along a Morton curve (LBVH).
+	/// Much faster to build than SAH, at the cost of a lower quality tree
+	void buildLinear(const std::vector<AABB>& primitiveAABBs, unsigned maxPrimitivesPerLeaf, unsigned maxDepth = s_MaxDepth - 1);
+	/// Recomputes every node's bounds from updated primitive boxes while keeping the topology
+	void refit(const std::vector<AABB>& primitiveAABBs);
+	/// Replaces the tree with nodes and primitives that were built before, for example read from a file
+	void assign(const WideNode* nodes, size_t nodeCount, const int* primitives, size_t primitiveCount);
+	void assign(const QuantizedNode* nodes, size_t nodeCount, const int* primitives, size_t primitiveCount);
+	/// Replaces the nodes with QuantizedNodes, later refits keep them quantized. Fails when a leaf
+	/// holds more primitives than a QuantizedNode can count, the tree is left untouched then
+	bool quantize();
+	void clear();
+
+	bool empty() const;
+	bool quantized() const;
+	/// SAH cost of the tree relative to the root's surface area, used to judge its quality
+	float sahCost() const;
+	/// Counts the tree's nodes and leaves, leaves holding more than maxPrimitivesPerLeaf are reported as oversized
+	BVHStats stats(unsigned maxPrimitivesPerLeaf) const;
+	const std::vector<WideNode>& nodes() const;
+	const std::vector<QuantizedNode>& quantizedNodes() const;
+	const std::vector<int>& primitives() const;
+
+	/// Slab test against all children of a node. Returns a mask of the children entered before maxT
+	static int intersectChildren(const WideNode& node, const SIMDRay& ray, float maxT, float entryT[s_Width]);
+	static int intersectChildren(const QuantizedNode& node, const SIMDRay& ray, float maxT, float entryT[s_Width]);
+	/// Pushes the children of a node entered before maxT far to near, so the nearest one is popped first
+	template<typename Node>
+	static void pushChildren(const Node& node, const SIMDRay& ray, float maxT, StackEntry* stack, unsigned& stackSize);
+	/// Child planes of a node as floats, laid out like WideNode's
+	static void childPlanes(const WideNode& node, float lower[3][s_Width], float upper[3][s_Width]);
+	static void childPlanes(const QuantizedNode& node, float lower[3][s_Width], float upper[3][s_Width]);
+	/// Slab test of one child against the packet. Returns the mask of active rays entering it before their maxT
+	static int intersectPacket(const float lower[3][s_Width], const float upper[3][s_Width], int slot, const RayPacket& packet, __m128 maxT, int activeMask, float& entryT);
+	/// Pushes the children entered by any active ray far to near, ordered by the packet's earliest entry
+	template<typename Node>
+	static void pushChildren(const Node& node, const RayPacket& packet, __m128 maxT, int activeMask, PacketStackEntry* stack, unsigned& stackSize);
+
+	/// Binned SAH partition of the primitives. Falls back to halving the list when no plane separates them
+	static void partitionSAH(const std::vector<int>& primitives, const std::vector<AABB>& primitiveAABBs, std::vector<int>& left, std::vector<int>& right);
+
+private:
+	// Binary node, only used while building before being collapsed into wide nodes
+	struct LinearNode
+	{
+		AABB aabb;
+		unsigned offset; // < Interior nodes: index of the second child, leaves: first primitive
+		unsigned count;  // < Primitive count, zero for interior nodes
+
+		bool isLeaf() const { return count != 0; }
+	};
+
+private:
+	std::vector<WideNode> m_Nodes;
+	std::vector<QuantizedNode> m_QuantizedNodes; // < Replaces m_Nodes once quantized
+	std::vector<int> m_Primitives;
+
+	struct LinearBuildContext;
+	static BVHBuildNode* buildLinearNode(LinearBuildContext& context, BVHBuildTree& tree, unsigned radixNode, size_t begin, size_t end, unsigned depth);
+	static AABB fitBounds(BVHBuildNode* node);
+	static BVHBuildNode* buildNode(BVHBuildTree& tree, std::vector<int>& primitives, const std::vector<AABB>& primitiveAABBs, unsigned maxPrimitivesPerLeaf, unsigned depth);
+	void flatten(const BVHBuildNode* node, std::vector<LinearNode>& binaryNodes);
+	int collapse(const std::vector<LinearNode>& binaryNodes, unsigned index);
+	void refitNode(WideNode& node, const std::vector<AABB>& primitiveAABBs);
+	template<typename Node>
+	static float sahCost(const std::vector<Node>& nodes);
+	template<typename Node>
+	void collectStats(const std::vector<Node>& nodes, unsigned maxPrimitivesPerLeaf, BVHStats& stats) const;
+	static QuantizedNode quantizeNode(const WideNode& node);
+	static WideNode dequantizeNode(const QuantizedNode& node);
+	template<typename Node>
+	static AABB nodeAABB(const Node& node);
+	static AABB childAABB(const WideNode& node, int slot);
+	static AABB childAABB(const QuantizedNode& node, int slot);
+	static void setChild(WideNode& node, int slot, const AABB& aabb, int child, unsigned count);
+};
+
+inline BVH::SIMDRay::SIMDRay(const Ray& ray)
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		origin[axis] = _mm_set1_ps(ray.origin()[axis]);
+		direction[axis] = _mm_set1_ps(ray.direction()[axis]);
+		invDirection[axis] = _mm_set1_ps(ray.invDirection()[axis]);
+		originInvDirection[axis] = _mm_set1_ps(ray.originInvDirection()[axis]);
+		negative[axis] = ray.isNegative(axis);
+	}
+}
+
+inline int BVH::intersectChildren(const WideNode& node, const SIMDRay& ray, float maxT, float entryT[s_Width])
+{
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(maxT);
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		// The near plane is picked by the direction's sign, so empty slots
+		// (lower = +max, upper = -max) always end up with t0 > t1. The ray's
+		// reciprocal direction is finite, so no distance is ever NaN
+		const float* nearPlanes = ray.negative[axis] ? node.upper[axis] : node.lower[axis];
+		const float* farPlanes = ray.negative[axis] ? node.lower[axis] : node.upper[axis];
+
+		const __m128 tNear = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(nearPlanes), ray.invDirection[axis]), ray.originInvDirection[axis]);
+		const __m128 tFar = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(farPlanes), ray.invDirection[axis]), ray.originInvDirection[axis]);
+
+		t0 = _mm_max_ps(tNear, t0);
+		t1 = _mm_min_ps(tFar, t1);
+	}
+
+	_mm_storeu_ps(entryT, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+// Decodes four quantized planes, lower + q * 2^exponent is exact as q has at most 8 bits
+inline __m128 dequantizePlanes(const uint8_t planes[BVH::s_Width], float origin, int exponent)
+{
+	int packed;
+	std::memcpy(&packed, planes, sizeof(packed));
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i values = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+	const __m128 scale = _mm_castsi128_ps(_mm_set1_epi32((exponent + 127) << 23));
+
+	return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(values), scale));
+}
+
+inline int BVH::intersectChildren(const QuantizedNode& node, const SIMDRay& ray, float maxT, float entryT[s_Width])
+{
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(maxT);
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const __m128 lower = dequantizePlanes(node.lower[axis], node.origin[axis], node.exponent[axis]);
+		const __m128 upper = dequantizePlanes(node.upper[axis], node.origin[axis], node.exponent[axis]);
+		const __m128 nearPlanes = ray.negative[axis] ? upper : lower;
+		const __m128 farPlanes = ray.negative[axis] ? lower : upper;
+
+		const __m128 tNear = _mm_sub_ps(_mm_mul_ps(nearPlanes, ray.invDirection[axis]), ray.originInvDirection[axis]);
+		const __m128 tFar = _mm_sub_ps(_mm_mul_ps(farPlanes, ray.invDirection[axis]), ray.originInvDirection[axis]);
+
+		t0 = _mm_max_ps(tNear, t0);
+		t1 = _mm_min_ps(tFar, t1);
+	}
+
+	_mm_storeu_ps(entryT, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+
+template<typename Node>
+inline void BVH::pushChildren(const Node& node, const SIMDRay& ray, float maxT, StackEntry* stack, unsigned& stackSize)
+{
+	float childT[s_Width];
+	const int hitMask = intersectChildren(node, ray, maxT, childT);
+
+	StackEntry hits[s_Width];
+	int hitCount = 0;
+	for (int slot = 0; slot < s_Width; slot++)
+	{
+		if ((hitMask & (1 << slot)) == 0)
+			continue;
+
+		int i = hitCount++;
+		for (; i > 0 && hits[i - 1].entryT < childT[slot]; i--)
+			hits[i] = hits[i - 1];
+		hits[i] = { node.child[slot], node.count[slot], childT[slot] };
+	}
+
+	assert(stackSize + hitCount <= s_MaxStackSize);
+	for (int i = 0; i < hitCount; i++)
+		stack[stackSize++] = hits[i];
+}
+
+inline void BVH::childPlanes(const WideNode& node, float lower[3][s_Width], float upper[3][s_Width])
+{
+	std::memcpy(lower, node.lower, sizeof(node.lower));
+	std::memcpy(upper, node.upper, sizeof(node.upper));
+}
+
+inline void BVH::childPlanes(const QuantizedNode& node, float lower[3][s_Width], float upper[3][s_Width])
+{
+	for (int axis = 0; axis < 3; axis++)
+	{
+		_mm_storeu_ps(lower[axis], dequantizePlanes(node.lower[axis], node.origin[axis], node.exponent[axis]));
+		_mm_storeu_ps(upper[axis], dequantizePlanes(node.upper[axis], node.origin[axis], node.exponent[axis]));
+	}
+}
+
+// The packet is tested against one child at a time, every lane holds a ray.
+// Unlike the single ray test the near plane is picked per ray with min/max,
+// so the packet does not need to share direction signs to be correct.
+inline int BVH::intersectPacket(const float lower[3][s_Width], const float upper[3][s_Width], int slot, const RayPacket& packet, __m128 maxT, int activeMask, float& entryT)
+{
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = maxT;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const __m128 tLower = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(lower[axis][slot]), packet.invDirection[axis]), packet.originInvDirection[axis]);
+		const __m128 tUpper = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(upper[axis][slot]), packet.invDirection[axis]), packet.originInvDirection[axis]);
+
+		t0 = _mm_max_ps(_mm_min_ps(tLower, tUpper), t0);
+		t1 = _mm_min_ps(_mm_max_ps(tLower, tUpper), t1);
+	}
+
+	const int mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & activeMask;
+	if (mask == 0)
+		return 0;
+
+	float entries[RayPacket::s_Size];
+	_mm_storeu_ps(entries, t0);
+
+	entryT = std::numeric_limits<float>::max();
+	for (int lane = 0; lane < RayPacket::s_Size; lane++)
+	{
+		if ((mask & (1 << lane)) != 0)
+			entryT = std::min(entryT, entries[lane]);
+	}
+
+	return mask;
+}
+
+template<typename Node>
+inline void BVH::pushChildren(const Node& node, const RayPacket& packet, __m128 maxT, int activeMask, PacketStackEntry* stack, unsigned& stackSize)
+{
+	float lower[3][s_Width];
+	float upper[3][s_Width];
+	childPlanes(node, lower, upper);
+
+	PacketStackEntry hits[s_Width];
+	int hitCount = 0;
+	for (int slot = 0; slot < s_Width; slot++)
+	{
+		// Min/max slab tests accept inverted boxes, so empty slots are skipped explicitly
+		if (node.isEmpty(slot))
+			continue;
+
+		float entryT;
+		const int mask = intersectPacket(lower, upper, slot, packet, maxT, activeMask, entryT);
+		if (mask == 0)
+			continue;
+
+		int i = hitCount++;
+		for (; i > 0 && hits[i - 1].entryT < entryT; i--)
+			hits[i] = hits[i - 1];
+		hits[i] = { node.child[slot], node.count[slot], entryT, mask };
+	}
+
+	assert(stackSize + hitCount <= s_MaxStackSize);
+	for (int i = 0; i < hitCount; i++)
+		stack[stackSize++] = hits[i];
+}
+
+#endif // !BVH_H
@@ -15,11 +15,20 @@ PoolAllocator::~PoolAllocator()
 
 void PoolAllocator::transferOwnership(PoolAllocator& other)
 {
-    Chunk* chunk = other.m_AllocatedMemory;
-    while (chunk->next)
-        chunk = chunk->next;
+    // The free chunks are appended to the other allocator's free list
+    if (other.m_AllocatedMemory == nullptr)
+    {
+        other.m_AllocatedMemory = m_AllocatedMemory;
+    }
+    else
+    {
+        Chunk* chunk = other.m_AllocatedMemory;
+        while (chunk->next)
+            chunk = chunk->next;
+
+        chunk->next = m_AllocatedMemory;
+    }
 
-    chunk->next = m_AllocatedMemory;
     m_AllocatedMemory = nullptr;
 
     other.m_AllocatedBlocks.splice(other.m_AllocatedBlocks.end(), m_AllocatedBlocks);
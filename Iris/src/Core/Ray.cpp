@@ -1,8 +1,24 @@
 #include "Ray.h"
 
+#include <cmath>
+
 Ray::Ray(const Point3f& origin, const Point3f& direction, unsigned depth)
-	: m_Origin(origin), m_Direction(direction), m_Depth(depth)
+	: m_Origin(origin), m_Direction(direction), m_SignMask(0), m_Depth(depth)
 {
+	// A zero component would give an infinite reciprocal, and infinity times a
+	// plane lying on the origin is NaN. Clamping keeps the result huge but
+	// finite, with the sign of the (possibly negative) zero.
+	constexpr float minComponent = 1.0e-20f;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		const float component = direction[axis];
+		const float safeComponent = std::abs(component) > minComponent ? component : std::copysign(minComponent, component);
+
+		m_InvDirection[axis] = 1.0f / safeComponent;
+		m_OriginInvDirection[axis] = origin[axis] * m_InvDirection[axis];
+		m_SignMask |= std::signbit(safeComponent) << axis;
+	}
 }
 
 const Point3f& Ray::origin() const
@@ -15,6 +31,26 @@ const Vector3f& Ray::direction() const
 	return m_Direction;
 }
 
+const Vector3f& Ray::invDirection() const
+{
+	return m_InvDirection;
+}
+
+const Vector3f& Ray::originInvDirection() const
+{
+	return m_OriginInvDirection;
+}
+
+int Ray::signMask() const
+{
+	return m_SignMask;
+}
+
+bool Ray::isNegative(int axis) const
+{
+	return (m_SignMask & (1 << axis)) != 0;
+}
+
 unsigned Ray::depth() const
 {
 	return m_Depth;
@@ -4,6 +4,9 @@
 
 #include <Containers/Vector3.h>
 
+// Besides origin and direction a ray carries the data every box test needs,
+// computed once here instead of once per visited node. Slab distances are
+// plane * invDirection - originInvDirection, a single FMA per plane.
 class Ray
 {
 public:
@@ -11,11 +14,21 @@ public:
 
 	const Point3f& origin() const;
 	const Vector3f& direction() const;
+	/// Reciprocal of the direction, kept finite for axis parallel rays so slab tests never produce NaN
+	const Vector3f& invDirection() const;
+	/// origin * invDirection
+	const Vector3f& originInvDirection() const;
+	/// Bit i is set when the direction is negative along axis i
+	int signMask() const;
+	bool isNegative(int axis) const;
 	Point3f at(float t) const;
 	unsigned depth() const;
 private:
 	Point3f m_Origin;
 	Point3f m_Direction;
+	Vector3f m_InvDirection;
+	Vector3f m_OriginInvDirection;
+	int m_SignMask;
 	unsigned m_Depth;
 };
 
@@ -0,0 +1,67 @@
+#ifndef RAY_PACKET_H
+
+#define RAY_PACKET_H
+
+#include <cassert>
+#include <emmintrin.h>
+#include <Core/Ray.h>
+
+// Up to four rays traced together, their data is laid out per lane so one
+// SSE instruction handles the whole packet. Only coherent rays, such as the
+// camera rays of neighbouring pixels, share enough of the BVH for this to
+// pay off. Inactive lanes repeat an active ray and their results are ignored.
+struct RayPacket
+{
+	static constexpr int s_Size = 4;
+
+	RayPacket(const Ray* const rays[s_Size], int activeMask);
+
+	static int count(int mask);
+
+	const Ray* rays[s_Size];
+	int activeMask;
+	bool coherent; // < All active rays point into the same octant
+
+	__m128 origin[3];
+	__m128 direction[3];
+	__m128 invDirection[3];
+	__m128 originInvDirection[3];
+};
+
+inline RayPacket::RayPacket(const Ray* const rays[s_Size], int activeMask)
+	: activeMask(activeMask), coherent(true)
+{
+	assert(activeMask > 0 && activeMask < (1 << s_Size));
+
+	int first = 0;
+	while ((activeMask & (1 << first)) == 0)
+		first++;
+
+	for (int lane = 0; lane < s_Size; lane++)
+	{
+		const bool active = (activeMask & (1 << lane)) != 0;
+		this->rays[lane] = active ? rays[lane] : rays[first];
+		coherent = coherent && this->rays[lane]->signMask() == rays[first]->signMask();
+	}
+
+	const Ray& r0 = *this->rays[0];
+	const Ray& r1 = *this->rays[1];
+	const Ray& r2 = *this->rays[2];
+	const Ray& r3 = *this->rays[3];
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		origin[axis] = _mm_setr_ps(r0.origin()[axis], r1.origin()[axis], r2.origin()[axis], r3.origin()[axis]);
+		direction[axis] = _mm_setr_ps(r0.direction()[axis], r1.direction()[axis], r2.direction()[axis], r3.direction()[axis]);
+		invDirection[axis] = _mm_setr_ps(r0.invDirection()[axis], r1.invDirection()[axis], r2.invDirection()[axis], r3.invDirection()[axis]);
+		originInvDirection[axis] = _mm_setr_ps(r0.originInvDirection()[axis], r1.originInvDirection()[axis], r2.originInvDirection()[axis], r3.originInvDirection()[axis]);
+	}
+}
+
+inline int RayPacket::count(int mask)
+{
+	static const int counts[1 << s_Size] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+	return counts[mask];
+}
+
+#endif // !RAY_PACKET_H
@@ -4,16 +4,65 @@
 #include <Utilities/Timer.h>
 #include <Utilities/Utility.h>
 #include <Objects/Material.h>
-
+#include <Core/ThreadPool.h>
+
+#include <cmath>
+#include <chrono>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <functional>
 
 #define MULTI_THREADING
 
 unsigned Renderer::s_MaxDepth = 10;
 bool Renderer::s_ShouldStop = false;
+bool Renderer::s_PacketTracing = true;
+bool Renderer::s_WavefrontTracing = false;
+Renderer::TileOrder Renderer::s_TileOrder = Renderer::TileOrder::Spiral;
+
+namespace
+{
+	// Interleaves the bits of x and y, buckets sorted by it follow a Z-order curve
+	uint32_t mortonIndex(uint32_t x, uint32_t y)
+	{
+		uint32_t index = 0;
+		for (unsigned bit = 0; bit < 16; bit++)
+			index |= ((x >> bit) & 1) << (2 * bit) | ((y >> bit) & 1) << (2 * bit + 1);
+
+		return index;
+	}
+
+	// Distance of (x, y) along a Hilbert curve filling a size x size grid, size a power of two
+	uint32_t hilbertIndex(uint32_t size, uint32_t x, uint32_t y)
+	{
+		uint32_t index = 0;
+		for (uint32_t s = size / 2; s > 0; s /= 2)
+		{
+			const uint32_t rx = (x & s) > 0;
+			const uint32_t ry = (y & s) > 0;
+			index += s * s * ((3 * rx) ^ ry);
+
+			// Rotates the quadrant so the curve's pieces connect
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = s - 1 - x;
+					y = s - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+
+		return index;
+	}
+}
 
 Renderer::Renderer()
-	: m_Image(Image(1, 1))
+	: m_Image(Image(1, 1)), m_RenderSeconds(0.0)
 {};
 
 void Renderer::render(const Scene& scene, unsigned sampleCount, unsigned threadCount)
@@ -21,27 +70,46 @@ void Renderer::render(const Scene& scene, unsigned sampleCount, unsigned threadC
 	s_ShouldStop = false;
 	const SceneSettings& settings = scene.settings();
 	m_Image = Image(settings.width, settings.height);
+	m_TraversalStats = TraversalStats();
 
 #ifdef MULTI_THREADING
 
-	const unsigned bucketSize = scene.settings().bucketSize;
-	Worker::createBuckets(bucketSize, scene);
+	// Workers run on the shared pool and the calling thread renders too. A caller that is a pool
+	// thread itself adds no thread, more workers would only queue up behind the others
+	ThreadPool& pool = ThreadPool::global();
+	const unsigned maxThreadCount = pool.threadCount() + (pool.currentWorker() < 0 ? 1 : 0);
+	threadCount = threadCount == 0 ? maxThreadCount : std::min(threadCount, maxThreadCount);
+	m_WorkerStats.assign(threadCount, WorkerStats());
 
-	threadCount = threadCount == 0 ? std::thread::hardware_concurrency() : threadCount;
+	const auto renderStart = std::chrono::steady_clock::now();
+
+	const unsigned bucketSize = scene.settings().bucketSize;
+	Worker::createBuckets(bucketSize, scene, threadCount);
 
-	std::vector<std::thread> threads;
-	threads.reserve(threadCount);
+	std::vector<Worker> workers;
+	workers.reserve(threadCount);
+	for (unsigned i = 0; i < threadCount; i++)
+		workers.emplace_back();
 
 	std::cout << "Rendering..." << std::endl;
 
 	{
 		Timer t;
-		for (size_t i = 0; i < threadCount; i++)
-			threads.emplace_back(Worker{}, std::ref(scene), std::ref(m_Image), sampleCount);
+		const auto workStart = std::chrono::steady_clock::now();
 
-		for (std::thread& thread : threads)
-			thread.join();
+		TaskGroup tasks(pool);
+		for (unsigned i = 1; i < threadCount; i++)
+			tasks.run([this, &workers, &scene, sampleCount, i]() { workers[i](scene, m_Image, sampleCount, m_TraversalStats, m_WorkerStats[i]); });
 
+		workers[0](scene, m_Image, sampleCount, m_TraversalStats, m_WorkerStats[0]);
+		tasks.wait();
+
+		const auto workEnd = std::chrono::steady_clock::now();
+		const double workSeconds = std::chrono::duration<double>(workEnd - workStart).count();
+		for (WorkerStats& workerStats : m_WorkerStats)
+			workerStats.idleSeconds = std::max(workSeconds - workerStats.busySeconds, 0.0);
+
+		m_RenderSeconds = std::chrono::duration<double>(workEnd - renderStart).count();
 		std::cout << "Render completed!\n";
 	}
 
@@ -58,6 +126,7 @@ void Renderer::render(const Scene& scene, unsigned sampleCount, unsigned threadC
 	std::cout << "Rendering..." << std::endl;
 	{
 		Timer t;
+		const TraversalStats statsBefore = TraversalStats::threadLocal();
 		for (unsigned row = 0; row < height; row++)
 		{
 			std::cout << "Progress: " << (int)(((row + 1) / (float)height) * 100) << "%\r";
@@ -75,11 +144,22 @@ void Renderer::render(const Scene& scene, unsigned sampleCount, unsigned threadC
 				m_Image.setPixel(col, row, color);
 			}
 		}
+
+		m_TraversalStats = TraversalStats::threadLocal();
+		m_TraversalStats.rays -= statsBefore.rays;
+		m_TraversalStats.nodesVisited -= statsBefore.nodesVisited;
+		m_TraversalStats.primitiveTests -= statsBefore.primitiveTests;
 	}
 
 #endif // MULTI-THREADING
 
-	std::cout << "\n" << std::endl;
+	std::cout << "\n";
+
+	const double rayCount = static_cast<double>(std::max<uint64_t>(m_TraversalStats.rays, 1));
+	std::cout << "Rays: " << m_TraversalStats.rays
+		<< " | Nodes per ray: " << m_TraversalStats.nodesVisited / rayCount
+		<< " | Triangles per ray: " << m_TraversalStats.primitiveTests / rayCount
+		<< " | Skipped repeats per ray: " << m_TraversalStats.mailboxHits / rayCount << "\n" << std::endl;
 }
 
 void Renderer::saveRender(const char* filePath)
@@ -93,11 +173,71 @@ void Renderer::setMaxDepth(unsigned maxDepth)
 	s_MaxDepth = maxDepth;
 }
 
+unsigned Renderer::maxDepth()
+{
+	return s_MaxDepth;
+}
+
 const Image& Renderer::image() const
 {
 	return m_Image;
 }
 
+const TraversalStats& Renderer::traversalStats() const
+{
+	return m_TraversalStats;
+}
+
+const std::vector<Renderer::WorkerStats>& Renderer::workerStats() const
+{
+	return m_WorkerStats;
+}
+
+double Renderer::renderSeconds() const
+{
+	return m_RenderSeconds;
+}
+
+void Renderer::benchmarkTileOrders(const Scene& scene, unsigned sampleCount, unsigned threadCount)
+{
+	const TileOrder orders[] = { TileOrder::Scanline, TileOrder::Spiral, TileOrder::Morton, TileOrder::Hilbert,
+		TileOrder::Checkerboard, TileOrder::Random, TileOrder::CostSorted };
+
+	const TileOrder previousOrder = s_TileOrder;
+
+	std::ostringstream report;
+	report << std::fixed << std::setprecision(3)
+		<< std::left << std::setw(14) << "Order" << std::right
+		<< std::setw(10) << "Wall (s)" << std::setw(12) << "Busy (s)" << std::setw(12) << "Idle (s)"
+		<< std::setw(12) << "Max idle" << std::setw(10) << "Tiles" << std::setw(14) << "Jump (px)" << "\n";
+
+	for (TileOrder order : orders)
+	{
+		s_TileOrder = order;
+		render(scene, sampleCount, threadCount);
+
+		double busySeconds = 0.0, idleSeconds = 0.0, maxIdleSeconds = 0.0, tileDistance = 0.0;
+		unsigned tiles = 0;
+		for (const WorkerStats& workerStats : m_WorkerStats)
+		{
+			busySeconds += workerStats.busySeconds;
+			idleSeconds += workerStats.idleSeconds;
+			maxIdleSeconds = std::max(maxIdleSeconds, workerStats.idleSeconds);
+			tileDistance += workerStats.tileDistance;
+			tiles += workerStats.tiles;
+		}
+
+		// Jumps are only counted between tiles of the same worker
+		const unsigned jumps = tiles > m_WorkerStats.size() ? tiles - unsigned(m_WorkerStats.size()) : 1;
+		report << std::left << std::setw(14) << tileOrderName(order) << std::right
+			<< std::setw(10) << m_RenderSeconds << std::setw(12) << busySeconds << std::setw(12) << idleSeconds
+			<< std::setw(12) << maxIdleSeconds << std::setw(10) << tiles << std::setw(14) << tileDistance / jumps << "\n";
+	}
+
+	s_TileOrder = previousOrder;
+	std::cout << "Tile orders, busy and idle time summed over " << m_WorkerStats.size() << " workers:\n" << report.str() << std::endl;
+}
+
 Color Renderer::traceRay(const Ray& ray, const Scene& scene)
 {
 	if (ray.depth() >= s_MaxDepth)
@@ -111,63 +251,277 @@ Color Renderer::traceRay(const Ray& ray, const Scene& scene)
 	return context.material->shadeScene(ray, scene, context);
 }
 
+void Renderer::tracePacket(const RayPacket& packet, const Scene& scene, Color colors[RayPacket::s_Size])
+{
+	// Rays pointing into different octants split up early, tracing them apart is cheaper
+	if (!packet.coherent || packet.rays[0]->depth() >= s_MaxDepth)
+	{
+		for (int lane = 0; lane < RayPacket::s_Size; lane++)
+		{
+			if ((packet.activeMask & (1 << lane)) != 0)
+				colors[lane] = traceRay(*packet.rays[lane], scene);
+		}
+		return;
+	}
+
+	Surface::Context contexts[RayPacket::s_Size];
+	const int hitMask = scene.isHit(packet, contexts, 0.000001f, std::numeric_limits<float>::max());
+
+	for (int lane = 0; lane < RayPacket::s_Size; lane++)
+	{
+		if ((packet.activeMask & (1 << lane)) == 0)
+			continue;
+
+		const Ray& ray = *packet.rays[lane];
+		if ((hitMask & (1 << lane)) != 0)
+			colors[lane] = contexts[lane].material->shadeScene(ray, scene, contexts[lane]);
+		else
+			colors[lane] = scene.settings().background.getColor(ray);
+	}
+}
+
 void Renderer::shouldStop(bool stop)
 {
 	s_ShouldStop = stop;
 }
 
+void Renderer::setPacketTracing(bool enabled)
+{
+	s_PacketTracing = enabled;
+}
+
+void Renderer::setWavefrontTracing(bool enabled)
+{
+	s_WavefrontTracing = enabled;
+}
+
+void Renderer::setTileOrder(TileOrder order)
+{
+	s_TileOrder = order;
+}
+
+const char* Renderer::tileOrderName(TileOrder order)
+{
+	switch (order)
+	{
+	case TileOrder::Scanline:		return "Scanline";
+	case TileOrder::Spiral:			return "Spiral";
+	case TileOrder::Morton:			return "Morton";
+	case TileOrder::Hilbert:		return "Hilbert";
+	case TileOrder::Checkerboard:	return "Checkerboard";
+	case TileOrder::Random:			return "Random";
+	case TileOrder::CostSorted:		return "CostSorted";
+	}
+
+	return "Unknown";
+}
+
 Renderer::Worker::Worker()
-	: m_Id(s_NextId++), m_BlockX(0), m_BlockY(0)
+	: m_Id(s_NextId++), m_BlockX(0), m_BlockY(0), m_BlockWidth(0), m_BlockHeight(0)
 {
 }
 
-void Renderer::Worker::operator()(const Scene& scene, Image& image, unsigned sampleCount)
+void Renderer::Worker::operator()(const Scene& scene, Image& image, unsigned sampleCount, TraversalStats& traversalStats, WorkerStats& workerStats)
 {
-	const Camera& camera = scene.camera();
+	// Pool threads outlive the render and keep counting, so only what this worker added is merged
+	const TraversalStats statsBefore = TraversalStats::threadLocal();
+
+	renderBuckets(scene, image, sampleCount, workerStats);
 
+	TraversalStats localStats = TraversalStats::threadLocal();
+	localStats.rays -= statsBefore.rays;
+	localStats.nodesVisited -= statsBefore.nodesVisited;
+	localStats.primitiveTests -= statsBefore.primitiveTests;
+	localStats.mailboxHits -= statsBefore.mailboxHits;
+
+	std::lock_guard<std::mutex> lock(s_Mutex);
+	traversalStats += localStats;
+}
+
+void Renderer::Worker::renderBuckets(const Scene& scene, Image& image, unsigned sampleCount, WorkerStats& workerStats)
+{
 	std::vector<Ray> rays;
 	rays.reserve(sampleCount);
 
-	assert(s_Buckets.size() > 0);
+	Wavefront wavefront(scene);
+
+	assert(s_Queues.size() > 0);
+
+	bool hasPreviousTile = false;
+	float previousX = 0.0f, previousY = 0.0f;
 
 	while (assignBucket())
 	{
 		if (s_ShouldStop)
 			return;
 
-		if (m_Id == 0)
-			std::cout << "Progress: " << (int)((s_CompletedBuckets) / (float)s_BucketCount * 100) << "%\r";
+		// Distance between consecutive tiles, long jumps leave less of the scene in cache
+		const float centerX = m_BlockX + m_BlockWidth * 0.5f;
+		const float centerY = m_BlockY + m_BlockHeight * 0.5f;
+		if (hasPreviousTile)
+			workerStats.tileDistance += std::hypot(centerX - previousX, centerY - previousY);
+
+		hasPreviousTile = true;
+		previousX = centerX;
+		previousY = centerY;
+		workerStats.tiles++;
+
+		const auto tileStart = std::chrono::steady_clock::now();
+		renderTile(scene, image, sampleCount, wavefront, rays);
+		workerStats.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - tileStart).count();
+
+		s_CompletedPixels += m_BlockWidth * m_BlockHeight;
+	}
+}
+
+void Renderer::Worker::renderTile(const Scene& scene, Image& image, unsigned sampleCount, Wavefront& wavefront, std::vector<Ray>& rays)
+{
+	if (m_Id == 0)
+		std::cout << "Progress: " << (int)(s_CompletedPixels / (float)(s_ImageWidth * s_ImageHeight) * 100) << "%\r";
+
+	if (s_WavefrontTracing)
+	{
+		renderBucketWavefront(wavefront, image, sampleCount);
+		return;
+	}
+
+	if (s_PacketTracing)
+	{
+		renderBucketPackets(scene, image, sampleCount);
+		return;
+	}
 
-		for (unsigned row = m_BlockY; row < (m_BlockY + s_BucketSize); row++)
+	const Camera& camera = scene.camera();
+	for (unsigned row = m_BlockY; row < m_BlockY + m_BlockHeight; row++)
+	{
+		for (unsigned col = m_BlockX; col < m_BlockX + m_BlockWidth; col++)
 		{
-			for (unsigned col = m_BlockX; col < (m_BlockX + s_BucketSize); col++)
+			Color color;
+			camera.generateRays(col, row, rays, sampleCount);
+
+			for (unsigned i = 0; i < sampleCount; i++)
+				color += traceRay(rays[i], scene);
+
+			rays.clear();
+			color *= 1.0f / sampleCount;
+			color = clamp(color, 0.0f, 1.0f);
+			image.setPixel(col, row, color);
+		}
+	}
+}
+
+// Every sample index of a 2x2 pixel block is traced as one packet. Lanes of
+// pixels outside the image or the bucket are left inactive.
+void Renderer::Worker::renderBucketPackets(const Scene& scene, Image& image, unsigned sampleCount)
+{
+	const Camera& camera = scene.camera();
+
+	std::vector<Ray> rays[RayPacket::s_Size];
+	for (std::vector<Ray>& pixelRays : rays)
+		pixelRays.reserve(sampleCount);
+
+	const unsigned rowEnd = m_BlockY + m_BlockHeight;
+	const unsigned colEnd = m_BlockX + m_BlockWidth;
+
+	for (unsigned row = m_BlockY; row < rowEnd; row += 2)
+	{
+		for (unsigned col = m_BlockX; col < colEnd; col += 2)
+		{
+			int activeMask = 0;
+			const Ray* packetRays[RayPacket::s_Size] = {};
+			Color colors[RayPacket::s_Size];
+			Color pixelColors[RayPacket::s_Size];
+
+			for (int lane = 0; lane < RayPacket::s_Size; lane++)
 			{
-				if (row >= s_ImageHeight || col >= s_ImageWidth)
-					break;
+				rays[lane].clear();
+
+				const unsigned x = col + (lane & 1);
+				const unsigned y = row + (lane >> 1);
+				if (x < colEnd && y < rowEnd)
+				{
+					camera.generateRays(x, y, rays[lane], sampleCount);
+					activeMask |= 1 << lane;
+				}
+			}
 
-				Color color;
-				camera.generateRays(col, row, rays, sampleCount);
+			for (unsigned i = 0; i < sampleCount; i++)
+			{
+				for (int lane = 0; lane < RayPacket::s_Size; lane++)
+					packetRays[lane] = (activeMask & (1 << lane)) != 0 ? &rays[lane][i] : nullptr;
 
-				for (unsigned i = 0; i < sampleCount; i++)
-					color += traceRay(rays[i], scene);
+				tracePacket(RayPacket(packetRays, activeMask), scene, colors);
 
-				rays.clear();
+				for (int lane = 0; lane < RayPacket::s_Size; lane++)
+					pixelColors[lane] += colors[lane];
+			}
+
+			for (int lane = 0; lane < RayPacket::s_Size; lane++)
+			{
+				if ((activeMask & (1 << lane)) == 0)
+					continue;
+
+				Color color = pixelColors[lane];
 				color *= 1.0f / sampleCount;
 				color = clamp(color, 0.0f, 1.0f);
-				image.setPixel(col, row, color);
+				image.setPixel(col + (lane & 1), row + (lane >> 1), color);
 			}
 		}
+	}
+}
+
+// All samples of the bucket form the first batch of the wavefront
+void Renderer::Worker::renderBucketWavefront(Wavefront& wavefront, Image& image, unsigned sampleCount)
+{
+	const Camera& camera = wavefront.scene().camera();
+
+	const unsigned rowEnd = m_BlockY + m_BlockHeight;
+	const unsigned colEnd = m_BlockX + m_BlockWidth;
+	const unsigned width = m_BlockWidth;
+
+	wavefront.reset(m_BlockWidth * m_BlockHeight);
+
+	std::vector<Ray> rays;
+	rays.reserve(sampleCount);
 
-		s_CompletedBuckets++;
+	for (unsigned row = m_BlockY; row < rowEnd; row++)
+	{
+		for (unsigned col = m_BlockX; col < colEnd; col++)
+		{
+			camera.generateRays(col, row, rays, sampleCount);
+
+			const unsigned pixel = (row - m_BlockY) * width + (col - m_BlockX);
+			for (const Ray& ray : rays)
+				wavefront.addCameraRay(ray, pixel);
+
+			rays.clear();
+
+			// Camera rays are fed a batch at a time, so memory does not grow with the tile and sample count
+			if (wavefront.batchFull())
+				wavefront.trace();
+		}
+	}
+
+	wavefront.trace();
+
+	for (unsigned row = m_BlockY; row < rowEnd; row++)
+	{
+		for (unsigned col = m_BlockX; col < colEnd; col++)
+		{
+			Color color = wavefront.pixel((row - m_BlockY) * width + (col - m_BlockX));
+			color *= 1.0f / sampleCount;
+			color = clamp(color, 0.0f, 1.0f);
+			image.setPixel(col, row, color);
+		}
 	}
 }
 
-void Renderer::Worker::createBuckets(unsigned bucketSize, const Scene& scene)
+void Renderer::Worker::createBuckets(unsigned bucketSize, const Scene& scene, unsigned threadCount)
 {
-	s_RenderFlag = false;
+	assert(threadCount > 0);
 
 	s_NextId = 0;
-	s_CompletedBuckets = 0;
+	s_CompletedPixels = 0;
 	s_BucketSize = bucketSize;
 	s_ImageWidth = scene.settings().width;
 	s_ImageHeight = scene.settings().height;
@@ -176,84 +530,332 @@ void Renderer::Worker::createBuckets(unsigned bucketSize, const Scene& scene)
 	s_BucketHCap = (s_ImageHeight + s_BucketSize - 1) / s_BucketSize;
 	s_BucketCount = s_BucketHCap * s_BucketWCap;
 
-	s_Buckets.resize(s_BucketHCap);
-	for (std::vector<bool>& bucket : s_Buckets)
+	s_Queues.clear();
+	for (unsigned i = 0; i < threadCount; i++)
+		s_Queues.emplace_back(std::make_unique<TileQueue>());
+
+	// Dealt out in turns, so every worker's queue keeps the order of the
+	// tiles and expensive regions are shared among all workers
+	const std::vector<Tile> tiles = s_TileOrder == TileOrder::CostSorted ? costTiles(scene, threadCount) : bucketTiles(s_TileOrder);
+	for (size_t i = 0; i < tiles.size(); i++)
+		s_Queues[i % threadCount]->tiles.push_back(tiles[i]);
+
+	s_PendingTiles = static_cast<unsigned>(tiles.size());
+}
+
+std::vector<Renderer::Worker::Tile> Renderer::Worker::bucketTiles(TileOrder tileOrder)
+{
+	const std::vector<Bucket> order = bucketOrder(tileOrder);
+
+	std::vector<Tile> tiles;
+	tiles.reserve(order.size());
+	for (const Bucket& bucket : order)
 	{
-		bucket.clear();
-		bucket.resize(s_BucketWCap);
+		const unsigned x = bucket.x * s_BucketSize;
+		const unsigned y = bucket.y * s_BucketSize;
+		tiles.push_back({ x, y, std::min(s_BucketSize, s_ImageWidth - x), std::min(s_BucketSize, s_ImageHeight - y) });
 	}
+
+	return tiles;
 }
 
-bool Renderer::Worker::assignBucket()
+// The screen is split like a kd-tree until every tile's estimated cost is
+// below an even share of the frame. Tiles are then sorted most expensive
+// first, so the longest tiles start early and the cheap ones fill the gaps
+// at the end.
+std::vector<Renderer::Worker::Tile> Renderer::Worker::costTiles(const Scene& scene, unsigned threadCount)
 {
-	bool hasAssigned = false;
+	const CostMap costMap = estimateCosts(scene);
+	const double maxCost = costMap.cost(0, 0, costMap.columns, costMap.rows) / (threadCount * s_TilesPerWorker);
 
-	std::lock_guard<std::mutex> lock(s_Mutex);
+	std::vector<std::pair<double, Tile>> costTiles;
+	splitByCost(costMap, 0, 0, costMap.columns, costMap.rows, maxCost, costTiles);
+
+	std::stable_sort(costTiles.begin(), costTiles.end(), [](const std::pair<double, Tile>& lhs, const std::pair<double, Tile>& rhs) { return lhs.first > rhs.first; });
+
+	std::vector<Tile> tiles;
+	tiles.reserve(costTiles.size());
+	for (const std::pair<double, Tile>& costTile : costTiles)
+		tiles.push_back(costTile.second);
+
+	return tiles;
+}
+
+// One path through the center of every cell at one sample, its cost is
+// the traversal work it caused: rays traced, nodes visited and primitives tested
+Renderer::Worker::CostMap Renderer::Worker::estimateCosts(const Scene& scene)
+{
+	CostMap costMap;
+	costMap.columns = (s_ImageWidth + s_CostCellSize - 1) / s_CostCellSize;
+	costMap.rows = (s_ImageHeight + s_CostCellSize - 1) / s_CostCellSize;
+
+	std::vector<double> costs(costMap.columns * costMap.rows);
+	parallelFor(costMap.rows, 1, [&](size_t begin, size_t end)
 	{
-		int x, y;
-		while (!hasAssigned)
-		{
-			fecthNextBucket(x, y);
-			if (y < 0 || y >= s_BucketHCap || x < 0 || x >= s_BucketWCap)
-				break;
+		const Camera& camera = scene.camera();
+		const TraversalStats& stats = TraversalStats::threadLocal();
 
-			if (!s_Buckets[y][x])
+		for (size_t row = begin; row < end; row++)
+		{
+			for (unsigned column = 0; column < costMap.columns; column++)
 			{
-				m_BlockX = x * s_BucketSize;
-				m_BlockY = y * s_BucketSize;
-				s_Buckets[y][x] = true;
+				const unsigned x = std::min(column * s_CostCellSize + s_CostCellSize / 2, s_ImageWidth - 1);
+				const unsigned y = std::min(unsigned(row) * s_CostCellSize + s_CostCellSize / 2, s_ImageHeight - 1);
+
+				const TraversalStats before = stats;
+				traceRay(camera.getRay(x + 0.5f, y + 0.5f), scene);
 
-				hasAssigned = true;
+				costs[row * costMap.columns + column] = double(stats.rays - before.rays)
+					+ double(stats.nodesVisited - before.nodesVisited)
+					+ double(stats.primitiveTests - before.primitiveTests);
 			}
 		}
+	});
+
+	const unsigned stride = costMap.columns + 1;
+	costMap.sums.assign(stride * (costMap.rows + 1), 0.0);
+	for (unsigned row = 0; row < costMap.rows; row++)
+	{
+		for (unsigned column = 0; column < costMap.columns; column++)
+		{
+			costMap.sums[(row + 1) * stride + column + 1] = costs[row * costMap.columns + column]
+				+ costMap.sums[row * stride + column + 1]
+				+ costMap.sums[(row + 1) * stride + column]
+				- costMap.sums[row * stride + column];
+		}
+	}
+
+	return costMap;
+}
+
+double Renderer::Worker::CostMap::cost(unsigned column0, unsigned row0, unsigned column1, unsigned row1) const
+{
+	const unsigned stride = columns + 1;
+	return sums[row1 * stride + column1] - sums[row0 * stride + column1] - sums[row1 * stride + column0] + sums[row0 * stride + column0];
+}
+
+// Halves the cost of the cell range along its longer side. Tiles are also
+// kept within four buckets per side, so cheap regions still spread over workers
+void Renderer::Worker::splitByCost(const CostMap& costMap, unsigned column0, unsigned row0, unsigned column1, unsigned row1, double maxCost, std::vector<std::pair<double, Tile>>& tiles)
+{
+	const double cost = costMap.cost(column0, row0, column1, row1);
+	const unsigned columns = column1 - column0;
+	const unsigned rows = row1 - row0;
+	const unsigned maxCells = std::max(4 * s_BucketSize / s_CostCellSize, 1u);
+
+	const bool isSmall = cost <= maxCost && columns <= maxCells && rows <= maxCells;
+	if (isSmall || (columns == 1 && rows == 1))
+	{
+		const unsigned x = column0 * s_CostCellSize;
+		const unsigned y = row0 * s_CostCellSize;
+		const Tile tile = { x, y, std::min(column1 * s_CostCellSize, s_ImageWidth) - x, std::min(row1 * s_CostCellSize, s_ImageHeight) - y };
+		tiles.push_back({ cost, tile });
+		return;
+	}
+
+	const bool splitColumns = columns >= rows;
+	const unsigned first = splitColumns ? column0 : row0;
+	const unsigned last = splitColumns ? column1 : row1;
+
+	// The split closest to half of the cost, but never an empty side
+	unsigned split = first + 1;
+	double bestDifference = std::numeric_limits<double>::max();
+	for (unsigned position = first + 1; position < last; position++)
+	{
+		const double leftCost = splitColumns ? costMap.cost(column0, row0, position, row1) : costMap.cost(column0, row0, column1, position);
+		const double difference = std::abs(2.0 * leftCost - cost);
+		if (difference < bestDifference)
+		{
+			bestDifference = difference;
+			split = position;
+		}
+	}
+
+	if (splitColumns)
+	{
+		splitByCost(costMap, column0, row0, split, row1, maxCost, tiles);
+		splitByCost(costMap, split, row0, column1, row1, maxCost, tiles);
+	}
+	else
+	{
+		splitByCost(costMap, column0, row0, column1, split, maxCost, tiles);
+		splitByCost(costMap, column0, split, column1, row1, maxCost, tiles);
+	}
+}
+
+// A worker only leaves once no tile is pending. Finding every queue empty is
+// not enough, another worker may be about to queue the pieces of a split.
+bool Renderer::Worker::assignBucket()
+{
+	Tile tile;
+	while (!takeTile(tile))
+	{
+		if (s_PendingTiles == 0 || s_ShouldStop)
+			return false;
+
+		std::this_thread::yield();
+	}
+
+	if (s_PendingTiles < s_SplitThreshold * s_Queues.size())
+		splitTile(tile);
+
+	// Pieces are queued by now, the taken tile stops being pending
+	s_PendingTiles--;
+
+	m_BlockX = tile.x;
+	m_BlockY = tile.y;
+	m_BlockWidth = tile.width;
+	m_BlockHeight = tile.height;
+	return true;
+}
+
+// The own queue is worked off from the front, others are robbed from the
+// back where the tiles their owners would reach last are
+bool Renderer::Worker::takeTile(Tile& tile)
+{
+	const unsigned queueCount = static_cast<unsigned>(s_Queues.size());
+
+	for (unsigned i = 0; i < queueCount; i++)
+	{
+		TileQueue& queue = *s_Queues[(m_Id + i) % queueCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (queue.tiles.empty())
+			continue;
+
+		if (i == 0)
+		{
+			tile = queue.tiles.front();
+			queue.tiles.pop_front();
+		}
+		else
+		{
+			tile = queue.tiles.back();
+			queue.tiles.pop_back();
+		}
 
-		return hasAssigned;
+		return true;
 	}
+
+	return false;
 }
 
-// Spiral pattern
-void Renderer::Worker::fecthNextBucket(int& varX, int& varY)
+// Keeps the top left quarter of the tile and queues the other quarters at
+// the front of the own queue, where idle workers can steal them
+void Renderer::Worker::splitTile(Tile& tile)
 {
-	static int x = -1;
-	static int y = 0;
+	const unsigned width = tile.width > s_MinTileSize ? (tile.width + 1) / 2 : tile.width;
+	const unsigned height = tile.height > s_MinTileSize ? (tile.height + 1) / 2 : tile.height;
+
+	if (width == tile.width && height == tile.height)
+		return;
 
-	static int dx = 1;
-	static int dy = 0;
-	static int t = 0;
-	static int cap = 0;
+	Tile pieces[3];
+	unsigned pieceCount = 0;
+	if (width < tile.width)
+		pieces[pieceCount++] = { tile.x + width, tile.y, tile.width - width, height };
+	if (height < tile.height)
+		pieces[pieceCount++] = { tile.x, tile.y + height, width, tile.height - height };
+	if (width < tile.width && height < tile.height)
+		pieces[pieceCount++] = { tile.x + width, tile.y + height, tile.width - width, tile.height - height };
 
-	if (!s_RenderFlag)
 	{
-		x = -1;
-		y = 0;
-
-		dx = 1;
-		dy = 0;
-		t = 0;
-		cap = 0;
-		s_RenderFlag = true;
+		TileQueue& queue = *s_Queues[m_Id % s_Queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		for (unsigned i = 0; i < pieceCount; i++)
+			queue.tiles.push_front(pieces[i]);
 	}
 
-	if ((dx == 1 && x - s_BucketWCap + cap + 1 == 0) || (dx == -1 && x == cap)
-		|| (dy == 1 && y - s_BucketHCap + cap + 1 == 0) || (dy == -1 && y == cap))
+	s_PendingTiles += pieceCount;
+	tile.width = width;
+	tile.height = height;
+}
+
+std::vector<Renderer::Worker::Bucket> Renderer::Worker::bucketOrder(TileOrder order)
+{
+	if (order == TileOrder::Spiral)
+		return spiralOrder();
+
+	std::vector<Bucket> buckets;
+	buckets.reserve(s_BucketCount);
+	for (unsigned y = 0; y < s_BucketHCap; y++)
 	{
-		t = dx;
-		dx = -dy;
-		dy = t;
+		for (unsigned x = 0; x < s_BucketWCap; x++)
+			buckets.push_back({ x, y });
+	}
+
+	uint32_t curveSize = 1;
+	while (curveSize < std::max(s_BucketWCap, s_BucketHCap))
+		curveSize *= 2;
 
-		if (x == cap && y == s_BucketHCap - cap - 1)
-			cap++;
+	const auto sortBy = [&buckets](const std::function<uint32_t(const Bucket&)>& key)
+	{
+		std::stable_sort(buckets.begin(), buckets.end(), [&key](const Bucket& lhs, const Bucket& rhs) { return key(lhs) < key(rhs); });
+	};
+
+	switch (order)
+	{
+	case TileOrder::Morton:
+		sortBy([](const Bucket& bucket) { return mortonIndex(bucket.x, bucket.y); });
+		break;
+	case TileOrder::Hilbert:
+		sortBy([curveSize](const Bucket& bucket) { return hilbertIndex(curveSize, bucket.x, bucket.y); });
+		break;
+	case TileOrder::Checkerboard:
+		sortBy([](const Bucket& bucket) { return (bucket.x + bucket.y) & 1; });
+		break;
+	case TileOrder::Random:
+		std::shuffle(buckets.begin(), buckets.end(), std::mt19937(s_BucketCount));
+		break;
+	default:
+		break;
 	}
 
-	x += dx;
-	y += dy;
+	return buckets;
+}
+
+// Clockwise spiral from the top left bucket inwards. The walk turns when it
+// reaches the border or a bucket it already visited, so every bucket is
+// visited exactly once
+std::vector<Renderer::Worker::Bucket> Renderer::Worker::spiralOrder()
+{
+	std::vector<Bucket> order;
+	order.reserve(s_BucketCount);
+
+	std::vector<bool> visited(s_BucketCount, false);
+	const auto isFree = [&](int x, int y)
+	{
+		return x >= 0 && y >= 0 && x < (int)s_BucketWCap && y < (int)s_BucketHCap && !visited[y * s_BucketWCap + x];
+	};
+
+	int x = 0, y = 0;
+	int dx = 1, dy = 0;
+	for (unsigned i = 0; i < s_BucketCount; i++)
+	{
+		visited[y * s_BucketWCap + x] = true;
+		order.push_back({ (unsigned)x, (unsigned)y });
+
+		if (!isFree(x + dx, y + dy))
+		{
+			const int t = dx;
+			dx = -dy;
+			dy = t;
+		}
+
+		x += dx;
+		y += dy;
+	}
 
-	varX = x;
-	varY = y;
+	return order;
 }
 
-std::vector<std::vector<bool>> Renderer::Worker::s_Buckets;
-std::atomic<unsigned> Renderer::Worker::s_CompletedBuckets{ 0 };
+std::vector<std::unique_ptr<Renderer::Worker::TileQueue>> Renderer::Worker::s_Queues;
+std::atomic<unsigned> Renderer::Worker::s_PendingTiles{ 0 };
+std::atomic<unsigned> Renderer::Worker::s_CompletedPixels{ 0 };
+constexpr unsigned Renderer::Worker::s_MinTileSize;
+constexpr unsigned Renderer::Worker::s_SplitThreshold;
+constexpr unsigned Renderer::Worker::s_CostCellSize;
+constexpr unsigned Renderer::Worker::s_TilesPerWorker;
 
 unsigned Renderer::Worker::s_NextId{};
 unsigned Renderer::Worker::s_BucketSize{};
@@ -262,6 +864,5 @@ unsigned Renderer::Worker::s_BucketHCap{};
 unsigned Renderer::Worker::s_BucketCount{};
 unsigned Renderer::Worker::s_ImageWidth{};
 unsigned Renderer::Worker::s_ImageHeight{};
-bool Renderer::Worker::s_RenderFlag{};
 
 std::mutex Renderer::Worker::s_Mutex{};
\ No newline at end of file
@@ -7,6 +7,7 @@
 
 #include <Core/Camera.h>
 #include <Core/Scene.h>
+#include <Core/Wavefront.h>
 
 #include <Containers/Vector2.h>
 #include <Containers/Color.h>
@@ -16,44 +17,144 @@
 #include <cassert>
 #include <thread>
 #include <mutex>
+#include <deque>
 
 class Renderer
 {
+public:
+	enum class TileOrder
+	{
+		Scanline,		// Rows of buckets from the top left
+		Spiral,			// Clockwise from the border inwards
+		Morton,			// Along a Z-order curve, consecutive buckets are mostly neighbours
+		Hilbert,		// Along a Hilbert curve, every bucket borders the one before it
+		Checkerboard,	// Every other bucket first, then the gaps, so neighbours go to different workers
+		Random,			// Shuffled with a fixed seed
+		CostSorted		// Sized and ordered by a cost map pre-pass, the most expensive tiles first
+	};
+
+	// Where a worker's time went during one render
+	struct WorkerStats
+	{
+		double busySeconds{};	// < Spent rendering tiles
+		double idleSeconds{};	// < Spent looking for tiles or waiting for the other workers to finish
+		unsigned tiles{};
+		double tileDistance{};	// < Summed distance in pixels between consecutive tiles, a proxy for cache misses
+	};
+
 public:
 	Renderer();
 	void render(const Scene& scene, unsigned sampleCount, unsigned threadCount = 0);
 	void saveRender(const char* filePath);
+	/// Renders the scene once with every tile order and prints the wall time, how busy the workers were
+	/// and how far apart their consecutive tiles were. The image of the last render is kept
+	void benchmarkTileOrders(const Scene& scene, unsigned sampleCount, unsigned threadCount = 0);
 
 	const Image& image() const;
+	const TraversalStats& traversalStats() const;
+	const std::vector<WorkerStats>& workerStats() const;
+	double renderSeconds() const;
 	
 	static void setMaxDepth(unsigned maxDepth);
+	static unsigned maxDepth();
 	static Color traceRay(const Ray& ray, const Scene& scene);
+	/// Traces the active rays of the packet, incoherent packets are traced one ray at a time
+	static void tracePacket(const RayPacket& packet, const Scene& scene, Color colors[RayPacket::s_Size]);
 	static void shouldStop(bool stop);
+	/// Traces camera rays of 2x2 pixel blocks as packets, on by default. Only the first hit of every ray is
+	/// found with packets, shading and secondary rays are traced one ray at a time
+	static void setPacketTracing(bool enabled);
+	/// Renders buckets with the wavefront integrator instead of tracing paths recursively, off by default.
+	/// Takes precedence over packet tracing
+	static void setWavefrontTracing(bool enabled);
+	/// Order in which tiles are dealt out to the workers, Spiral by default. CostSorted traces one path per
+	/// 8x8 pixels first and sizes tiles by the traversal work it counted, the other orders use uniform buckets
+	static void setTileOrder(TileOrder order);
+	static const char* tileOrderName(TileOrder order);
 
 private:
 	Image m_Image;
+	TraversalStats m_TraversalStats;
+	std::vector<WorkerStats> m_WorkerStats;
+	double m_RenderSeconds;
 	static unsigned s_MaxDepth;
 	static bool s_ShouldStop;
+	static bool s_PacketTracing;
+	static bool s_WavefrontTracing;
+	static TileOrder s_TileOrder;
 
 private:
 	class Worker
 	{
+		struct Bucket
+		{
+			unsigned x;
+			unsigned y;
+		};
+
+		// A rectangle of pixels, buckets clipped to the image at first and smaller pieces of them later
+		struct Tile
+		{
+			unsigned x;
+			unsigned y;
+			unsigned width;
+			unsigned height;
+		};
+
+		struct TileQueue
+		{
+			std::mutex mutex;
+			std::deque<Tile> tiles;
+		};
+
+		// Estimated cost of the image in cells of s_CostCellSize pixels, looked up by cell ranges
+		struct CostMap
+		{
+			unsigned columns;
+			unsigned rows;
+			std::vector<double> sums; // < Summed area table of (columns + 1) x (rows + 1) entries
+
+			double cost(unsigned column0, unsigned row0, unsigned column1, unsigned row1) const;
+		};
+
 	public:
 		Worker();
-		void operator()(const Scene& scene, Image& image, unsigned sampleCount);
-		static void createBuckets(unsigned bucketSize, const Scene& scene);
+		void operator()(const Scene& scene, Image& image, unsigned sampleCount, TraversalStats& traversalStats, WorkerStats& workerStats);
+		/// Splits the image into buckets and deals them out to the queues of threadCount workers
+		static void createBuckets(unsigned bucketSize, const Scene& scene, unsigned threadCount);
 
 	private:
+		void renderBuckets(const Scene& scene, Image& image, unsigned sampleCount, WorkerStats& workerStats);
+		void renderTile(const Scene& scene, Image& image, unsigned sampleCount, Wavefront& wavefront, std::vector<Ray>& rays);
+		void renderBucketPackets(const Scene& scene, Image& image, unsigned sampleCount);
+		void renderBucketWavefront(Wavefront& wavefront, Image& image, unsigned sampleCount);
 		bool assignBucket();
-		void fecthNextBucket(int& varX, int& varY);
+		bool takeTile(Tile& tile);
+		void splitTile(Tile& tile);
+		static std::vector<Bucket> bucketOrder(TileOrder order);
+		static std::vector<Bucket> spiralOrder();
+		static std::vector<Tile> bucketTiles(TileOrder order);
+		static std::vector<Tile> costTiles(const Scene& scene, unsigned threadCount);
+		static CostMap estimateCosts(const Scene& scene);
+		static void splitByCost(const CostMap& costMap, unsigned column0, unsigned row0, unsigned column1, unsigned row1, double maxCost, std::vector<std::pair<double, Tile>>& tiles);
 
 	private:
 		const unsigned m_Id;
 		unsigned m_BlockX;
 		unsigned m_BlockY;
-
-		static std::vector<std::vector<bool>> s_Buckets;
-		static std::atomic<unsigned> s_CompletedBuckets;
+		unsigned m_BlockWidth;
+		unsigned m_BlockHeight;
+
+		// Every worker owns a queue and takes tiles from its front, workers that run dry steal from
+		// the back of the others. Once only a few tiles per worker are left, taken tiles are split
+		// and the pieces are queued again, so all workers stay busy until the last pixel
+		static std::vector<std::unique_ptr<TileQueue>> s_Queues;
+		static std::atomic<unsigned> s_PendingTiles;   // < Queued tiles plus taken ones that may still be split
+		static std::atomic<unsigned> s_CompletedPixels;
+		static constexpr unsigned s_MinTileSize = 4;     // < Tiles this small are never split
+		static constexpr unsigned s_SplitThreshold = 4;  // < Pending tiles per worker below which tiles are split
+		static constexpr unsigned s_CostCellSize = 8;    // < Pixels per side of a cost map cell
+		static constexpr unsigned s_TilesPerWorker = 16; // < Cost based tiles are sized to give each worker about this many
 
 		static unsigned s_NextId;
 		static unsigned s_BucketSize;
@@ -63,9 +164,7 @@ private:
 		static unsigned s_ImageWidth;
 		static unsigned s_ImageHeight;
 
-		static bool s_RenderFlag; // < Tracks if a new render has started
-
-		static std::mutex s_Mutex;
+		static std::mutex s_Mutex; // < Guards merging the workers' traversal stats
 
 	};
 };
@@ -1,8 +1,10 @@
 #include "Scene.h"
 
 #include <fstream>
+#include <iostream>
 #include <cassert>
 #include <stdexcept>
+#include <unordered_set>
 
 #include <rapidjson/document.h>
 #include <rapidjson/istreamwrapper.h>
@@ -12,6 +14,7 @@
 #include <Objects/Materials/Reflective.h>
 #include <Objects/Materials/Refractive.h>
 #include <Objects/Materials/Emissive.h>
+#include <Objects/Surfaces/Instance.h>
 
 using namespace rapidjson;
 
@@ -21,6 +24,8 @@ Scene::Scene(const char* scenePath)
 	assert(scenePath);
 	loadScene(scenePath);
 	constructAABB();
+
+	std::cout << "Mesh BVHs:\n" << bvhStats() << std::endl;
 }
 
 Scene::Scene(const Camera& camera, const SceneSettings& settings)
@@ -29,7 +34,7 @@ Scene::Scene(const Camera& camera, const SceneSettings& settings)
 }
 
 Scene::Scene(const Scene& other)
-	: m_AABB(other.m_AABB), m_Camera(other.camera()), m_Settings(other.m_Settings)
+	: m_AABB(other.m_AABB), m_Camera(other.camera()), m_Settings(other.m_Settings), m_TopLevelBVH(other.m_TopLevelBVH)
 {
 	m_Objects.reserve(other.m_Objects.capacity());
 	for (const std::unique_ptr<Surface>& object : other.m_Objects)
@@ -61,25 +66,126 @@ Scene& Scene::operator=(Scene&& other) noexcept
 
 bool Scene::isHit(const Ray& ray, Surface::Context& context, float minT, float maxT) const
 {
-	if (!m_AABB.isHit(ray, maxT, maxT))
+	return traverse(ray, minT, maxT, false, &context);
+}
+
+bool Scene::isOccluded(const Ray& ray, float minT, float maxT) const
+{
+	return traverse(ray, minT, maxT, true, nullptr);
+}
+
+// Walks the top level BVH and hands the ray to every object whose box is
+// entered before the closest hit found so far. With anyHit set, objects
+// without shadows are skipped and the walk stops at the first hit.
+bool Scene::traverse(const Ray& ray, float minT, float maxT, bool anyHit, Surface::Context* context) const
+{
+	TraversalStats& stats = TraversalStats::threadLocal();
+	stats.rays++;
+
+	if (m_TopLevelBVH.empty())
 		return false;
 
+	const BVH::WideNode* bvhNodes = m_TopLevelBVH.nodes().data();
+	const int* bvhPrimitives = m_TopLevelBVH.primitives().data();
+	const BVH::SIMDRay simdRay(ray);
+
+	BVH::StackEntry stack[BVH::s_MaxStackSize];
+	stack[0] = { 0, 0, 0.0f };
+	unsigned stackSize = 1;
+
 	bool isHit = false;
-	Surface::Context tempContext;
+	Surface::Hit hit;
 
-	for (const std::unique_ptr<Surface>& surface : m_Objects) {
-		if (surface->isHit(ray, tempContext, minT, maxT))
+	while (stackSize > 0)
+	{
+		const BVH::StackEntry entry = stack[--stackSize];
+
+		if (entry.entryT > maxT)
+			continue;
+
+		if (entry.count == 0)
 		{
-			context = tempContext;
-			maxT = context.distance;
+			stats.nodesVisited++;
+			BVH::pushChildren(bvhNodes[entry.child], simdRay, maxT, stack, stackSize);
+			continue;
+		}
 
-			isHit = true;
+		for (unsigned i = entry.child; i < entry.child + entry.count; i++)
+		{
+			const Surface& surface = *m_Objects[bvhPrimitives[i]];
+
+			if (anyHit)
+			{
+				if (surface.material()->hasShadow() && surface.isOccluded(ray, minT, maxT))
+					return true;
+
+				continue;
+			}
+
+			if (surface.intersect(ray, hit, minT, maxT))
+			{
+				maxT = hit.distance;
+				isHit = true;
+			}
 		}
 	}
 
+	if (isHit && context != nullptr)
+		hit.surface->computeContext(ray, hit, *context);
+
 	return isHit;
 }
 
+// The packet walks the top level BVH together, objects are handed the rays
+// that entered their box before their closest hit found so far
+int Scene::isHit(const RayPacket& packet, Surface::Context contexts[RayPacket::s_Size], float minT, float maxT) const
+{
+	TraversalStats& stats = TraversalStats::threadLocal();
+	stats.rays += RayPacket::count(packet.activeMask);
+
+	if (m_TopLevelBVH.empty())
+		return 0;
+
+	const BVH::WideNode* bvhNodes = m_TopLevelBVH.nodes().data();
+	const int* bvhPrimitives = m_TopLevelBVH.primitives().data();
+
+	BVH::PacketStackEntry stack[BVH::s_MaxStackSize];
+	stack[0] = { 0, 0, 0.0f, packet.activeMask };
+	unsigned stackSize = 1;
+
+	int hitMask = 0;
+	Surface::Hit hits[RayPacket::s_Size];
+	float closestT[RayPacket::s_Size] = { maxT, maxT, maxT, maxT };
+
+	while (stackSize > 0)
+	{
+		const BVH::PacketStackEntry entry = stack[--stackSize];
+
+		const __m128 closest = _mm_loadu_ps(closestT);
+		const int mask = entry.mask & _mm_movemask_ps(_mm_cmpge_ps(closest, _mm_set1_ps(entry.entryT)));
+		if (mask == 0)
+			continue;
+
+		if (entry.count == 0)
+		{
+			stats.nodesVisited += RayPacket::count(mask);
+			BVH::pushChildren(bvhNodes[entry.child], packet, closest, mask, stack, stackSize);
+			continue;
+		}
+
+		for (unsigned i = entry.child; i < entry.child + entry.count; i++)
+			hitMask |= m_Objects[bvhPrimitives[i]]->intersectPacket(packet, mask, hits, minT, closestT);
+	}
+
+	for (int lane = 0; lane < RayPacket::s_Size; lane++)
+	{
+		if ((hitMask & (1 << lane)) != 0)
+			hits[lane].surface->computeContext(*packet.rays[lane], hits[lane], contexts[lane]);
+	}
+
+	return hitMask;
+}
+
 const SceneSettings& Scene::settings() const
 {
 	return m_Settings;
@@ -163,37 +269,51 @@ std::unique_ptr<Surface>& Scene::operator[](size_t index)
 	return m_Objects[index];
 }
 
+BVHStats Scene::bvhStats() const
+{
+	BVHStats stats;
+	std::unordered_set<const Mesh*> meshes;
+
+	for (const std::unique_ptr<Surface>& object : m_Objects)
+	{
+		const Mesh* mesh = dynamic_cast<const Mesh*>(object.get());
+		if (const Instance* instance = dynamic_cast<const Instance*>(object.get()))
+			mesh = instance->mesh().get();
+
+		if (mesh != nullptr && meshes.insert(mesh).second)
+			stats += mesh->bvhStats();
+	}
+
+	return stats;
+}
+
 void Scene::addObject(std::unique_ptr<Surface>&& object)
 {
-	m_AABB.combine(object->getAABB());
 	m_Objects.emplace_back(std::move(object));
+	constructAABB();
 }
 
 void Scene::addObjects(std::vector<std::unique_ptr<Surface>>& objects)
 {
 	for (std::unique_ptr<Surface>& object : objects)
-		addObject(std::move(object));
+		m_Objects.emplace_back(std::move(object));
+	constructAABB();
 }
 
+// Also rebuilds the top level BVH, as it has to follow the objects' boxes
 void Scene::constructAABB()
 {
-	Vector3f min = m_Objects[0]->getAABB().min();
-	Vector3f max = m_Objects[0]->getAABB().max();
+	std::vector<AABB> objectAABBs;
+	objectAABBs.reserve(m_Objects.size());
 
-	for (std::unique_ptr<Surface>& surface : m_Objects)
+	m_AABB = AABB();
+	for (const std::unique_ptr<Surface>& surface : m_Objects)
 	{
-		const AABB& aabb = surface->getAABB();
-
-		min.x() = std::min(min.x(), aabb.min().x());
-		min.y() = std::min(min.y(), aabb.min().y());
-		min.z() = std::min(min.z(), aabb.min().z());
-
-		max.x() = std::max(max.x(), aabb.max().x());
-		max.y() = std::max(max.y(), aabb.max().y());
-		max.z() = std::max(max.z(), aabb.max().z());
+		objectAABBs.push_back(surface->getAABB());
+		m_AABB.combine(surface->getAABB());
 	}
 
-	m_AABB = AABB(min, max);
+	m_TopLevelBVH.build(objectAABBs, 1);
 }
 
 void Scene::loadScene(const char* scenePath)
@@ -314,8 +434,38 @@ bool Scene::loadObjects(const rapidjson::Document& json)
 	if (!objects.IsNull() && objects.IsArray())
 	{
 		const GenericArray<true, Value>& objectBuffer = objects.GetArray();
-		for (const Value& object : objectBuffer)
-			m_Objects.emplace_back(loadMesh(object));
+
+		// Objects referenced by an instance are shared with it and placed
+		// through an instance of their own, the rest are owned by the scene
+		std::vector<bool> instanced(objectBuffer.Size(), false);
+		const Value::ConstMemberIterator instances = json.FindMember("instances");
+		if (instances != json.MemberEnd())
+		{
+			assert(!instances->value.IsNull() && instances->value.IsArray());
+			for (const Value& instance : instances->value.GetArray())
+			{
+				const Value& objectIndex = instance.FindMember("object_index")->value;
+				assert(!objectIndex.IsNull() && objectIndex.IsUint() && objectIndex.GetUint() < objectBuffer.Size());
+				instanced[objectIndex.GetUint()] = true;
+			}
+		}
+
+		std::vector<std::shared_ptr<const Mesh>> sharedMeshes(objectBuffer.Size());
+		for (unsigned i = 0; i < objectBuffer.Size(); i++)
+		{
+			if (!instanced[i])
+			{
+				m_Objects.emplace_back(loadMesh(objectBuffer[i]));
+				continue;
+			}
+
+			sharedMeshes[i] = loadMesh(objectBuffer[i]);
+			const int materialIndex = objectBuffer[i].FindMember("material_index")->value.GetInt();
+			m_Objects.emplace_back(std::make_unique<Instance>(sharedMeshes[i], m_Materials[materialIndex]));
+		}
+
+		if (instances != json.MemberEnd())
+			loadInstances(instances->value, objects, sharedMeshes);
 
 		return true;
 	}
@@ -323,6 +473,48 @@ bool Scene::loadObjects(const rapidjson::Document& json)
 	return false;
 }
 
+// "instances": [{ "object_index": 0, "material_index": 1, "matrix": [...], "position": [...] }]
+// Only "object_index" is required. The material defaults to the object's own,
+// the matrix is column major and defaults to identity, the position to the origin.
+void Scene::loadInstances(const rapidjson::Value& instances, const rapidjson::Value& objects, const std::vector<std::shared_ptr<const Mesh>>& sharedMeshes)
+{
+	for (const Value& instance : instances.GetArray())
+	{
+		const unsigned objectIndex = instance.FindMember("object_index")->value.GetUint();
+		const std::shared_ptr<const Mesh>& mesh = sharedMeshes[objectIndex];
+
+		std::shared_ptr<Material> material;
+		const Value::ConstMemberIterator materialIndex = instance.FindMember("material_index");
+		if (materialIndex != instance.MemberEnd())
+		{
+			assert(!materialIndex->value.IsNull() && materialIndex->value.IsUint());
+			material = m_Materials[materialIndex->value.GetUint()];
+		}
+		else
+		{
+			material = m_Materials[objects[objectIndex].FindMember("material_index")->value.GetInt()];
+		}
+
+		Matrix3 transformation;
+		const Value::ConstMemberIterator matrix = instance.FindMember("matrix");
+		if (matrix != instance.MemberEnd())
+		{
+			assert(!matrix->value.IsNull() && matrix->value.IsArray());
+			transformation = loadMatrix3(matrix->value.GetArray());
+		}
+
+		Point3f position;
+		const Value::ConstMemberIterator positionMember = instance.FindMember("position");
+		if (positionMember != instance.MemberEnd())
+		{
+			assert(!positionMember->value.IsNull() && positionMember->value.IsArray());
+			position = loadVector3f(positionMember->value.GetArray());
+		}
+
+		m_Objects.emplace_back(std::make_unique<Instance>(mesh, material, transformation, position));
+	}
+}
+
 rapidjson::Document Scene::parseJson(const char* jsonPath)
 {
 	std::ifstream inputStream(jsonPath);
@@ -510,6 +702,8 @@ void Scene::copy(const Scene& other)
 {
 	m_Settings = other.m_Settings;
 	m_Camera = other.m_Camera;
+	m_AABB = other.m_AABB;
+	m_TopLevelBVH = other.m_TopLevelBVH;
 
 	m_Objects.reserve(other.m_Objects.capacity());
 	for (const std::unique_ptr<Surface>& object : other.m_Objects)
@@ -521,4 +715,6 @@ void Scene::swap(Scene&& other)
 	std::swap(m_Settings, other.m_Settings);
 	std::swap(m_Camera, other.m_Camera);
 	std::swap(m_Objects, other.m_Objects);
+	std::swap(m_AABB, other.m_AABB);
+	std::swap(m_TopLevelBVH, other.m_TopLevelBVH);
 }
\ No newline at end of file
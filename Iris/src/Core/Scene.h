@@ -5,6 +5,7 @@
 #include <memory>
 
 #include <Core/AABB.h>
+#include <Core/BVH.h>
 #include <Core/Camera.h>
 #include <Core/CubeMap.h>
 #include <Objects/Light.h>
@@ -43,6 +44,10 @@ public:
 	Scene& operator=(Scene&& other) noexcept;
 
 	bool isHit(const Ray& ray, Surface::Context& context, float minT, float maxT) const;
+	// Closest hits of a packet of rays, returns the mask of the active rays that hit something
+	int isHit(const RayPacket& packet, Surface::Context contexts[RayPacket::s_Size], float minT, float maxT) const;
+	// Whether anything that casts a shadow lies on the ray between minT and maxT
+	bool isOccluded(const Ray& ray, float minT, float maxT) const;
 
 	const SceneSettings& settings() const;
 	SceneSettings& settings();
@@ -66,6 +71,9 @@ public:
 	const std::unique_ptr<Surface>& operator[](size_t index) const;
 	std::unique_ptr<Surface>& operator[](size_t index);
 
+	/// Combined statistics of the BVHs of all meshes, meshes shared by instances are counted once
+	BVHStats bvhStats() const;
+
 	void addObject(std::unique_ptr<Surface>&& object);
 	void addObjects(std::vector<std::unique_ptr<Surface>>& objects);
 
@@ -76,14 +84,17 @@ private:
 	std::vector<Light> m_Lights;
 	std::vector<std::unique_ptr<Surface>> m_Objects;
 	std::vector<std::shared_ptr<Material>> m_Materials;
+	BVH m_TopLevelBVH; // < Leaves reference indices of m_Objects
 
 	void constructAABB();
+	bool traverse(const Ray& ray, float minT, float maxT, bool anyHit, Surface::Context* context) const;
 	void loadScene(const char* scenePath);
 	bool loadSettings(const rapidjson::Document& json);
 	bool loadCamera(const rapidjson::Document& json);
 	bool loadLights(const rapidjson::Document& json);
 	bool loadMaterials(const rapidjson::Document& json);
 	bool loadObjects(const rapidjson::Document& json);
+	void loadInstances(const rapidjson::Value& instances, const rapidjson::Value& objects, const std::vector<std::shared_ptr<const Mesh>>& sharedMeshes);
 
 	rapidjson::Document parseJson(const char* jsonPath);
 	Vector3i loadVector3i(const rapidjson::GenericArray<true, rapidjson::Value>& array);
@@ -0,0 +1,175 @@
+#include "ThreadPool.h"
+
+#include <cassert>
+
+namespace
+{
+	// Index of the pool worker running on this thread and the pool it belongs to
+	thread_local int t_WorkerIndex = -1;
+	thread_local const ThreadPool* t_WorkerPool = nullptr;
+}
+
+ThreadPool::ThreadPool(unsigned threadCount)
+	: m_Stop(false), m_PendingTasks(0), m_NextQueue(0)
+{
+	if (threadCount == 0)
+		threadCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+	m_Queues.reserve(threadCount);
+	for (unsigned i = 0; i < threadCount; i++)
+		m_Queues.emplace_back(std::make_unique<Queue>());
+
+	m_Threads.reserve(threadCount);
+	for (unsigned i = 0; i < threadCount; i++)
+		m_Threads.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_SleepMutex);
+		m_Stop = true;
+	}
+	m_WakeUp.notify_all();
+
+	for (std::thread& thread : m_Threads)
+		thread.join();
+}
+
+unsigned ThreadPool::threadCount() const
+{
+	return static_cast<unsigned>(m_Threads.size());
+}
+
+void ThreadPool::submit(Task&& task)
+{
+	const int worker = currentWorker();
+	const unsigned index = worker >= 0 ? worker : m_NextQueue++ % m_Queues.size();
+
+	{
+		std::lock_guard<std::mutex> lock(m_Queues[index]->mutex);
+		m_Queues[index]->tasks.push_back(std::move(task));
+	}
+
+	{
+		// Taken so a worker can not miss the new task between checking and going to sleep
+		std::lock_guard<std::mutex> lock(m_SleepMutex);
+		m_PendingTasks++;
+	}
+	m_WakeUp.notify_one();
+}
+
+bool ThreadPool::runPendingTask()
+{
+	const int worker = currentWorker();
+
+	Task task;
+	if (!takeTask(worker >= 0 ? worker : 0, task))
+		return false;
+
+	task();
+	return true;
+}
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool(s_GlobalThreadCount);
+	s_GlobalCreated = true;
+	return pool;
+}
+
+void ThreadPool::setGlobalThreadCount(unsigned threadCount)
+{
+	assert(!s_GlobalCreated && "The global pool is already running");
+	s_GlobalThreadCount = threadCount;
+}
+
+void ThreadPool::workerLoop(unsigned index)
+{
+	t_WorkerIndex = static_cast<int>(index);
+	t_WorkerPool = this;
+
+	while (true)
+	{
+		Task task;
+		if (takeTask(index, task))
+		{
+			task();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_SleepMutex);
+		m_WakeUp.wait(lock, [this]() { return m_Stop || m_PendingTasks > 0; });
+
+		if (m_Stop)
+			return;
+	}
+}
+
+// The own queue is used as a stack for locality, the others are robbed from
+// the front where the oldest and usually largest tasks are
+bool ThreadPool::takeTask(unsigned index, Task& task)
+{
+	const unsigned queueCount = static_cast<unsigned>(m_Queues.size());
+
+	for (unsigned i = 0; i < queueCount; i++)
+	{
+		Queue& queue = *m_Queues[(index + i) % queueCount];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (queue.tasks.empty())
+			continue;
+
+		if (i == 0)
+		{
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+
+		m_PendingTasks--;
+		return true;
+	}
+
+	return false;
+}
+
+int ThreadPool::currentWorker() const
+{
+	return t_WorkerPool == this ? t_WorkerIndex : -1;
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool)
+	: m_Pool(pool), m_Pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+	wait();
+}
+
+void TaskGroup::run(ThreadPool::Task&& task)
+{
+	m_Pending++;
+	m_Pool.submit([this, task = std::move(task)]() {
+		task();
+		m_Pending--;
+	});
+}
+
+void TaskGroup::wait()
+{
+	while (m_Pending > 0)
+	{
+		if (!m_Pool.runPendingTask())
+			std::this_thread::yield();
+	}
+}
+
+unsigned ThreadPool::s_GlobalThreadCount{};
+std::atomic<bool> ThreadPool::s_GlobalCreated{ false };
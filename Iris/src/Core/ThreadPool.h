@@ -0,0 +1,111 @@
+#ifndef THREAD_POOL_H
+
+#define THREAD_POOL_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+// A fixed set of worker threads, each owning a task queue. Workers take the
+// newest task of their own queue and steal the oldest one of the others when
+// theirs runs dry, so recursively spawned work spreads over idle threads.
+class ThreadPool
+{
+public:
+	using Task = std::function<void()>;
+
+public:
+	/// Zero uses one thread per hardware thread but one, threads waiting on the pool run its tasks
+	/// and make up the last one
+	explicit ThreadPool(unsigned threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned threadCount() const;
+
+	/// Queues a task, tasks submitted from a worker go to that worker's queue
+	void submit(Task&& task);
+	/// Runs one queued task on the calling thread, returns false if there was none
+	bool runPendingTask();
+	/// Index of the pool's worker running on the calling thread, -1 for threads outside the pool
+	int currentWorker() const;
+
+	/// The pool shared by the whole process, created on first use
+	static ThreadPool& global();
+	/// Size of the global pool, has to be set before its first use. Zero picks it from the hardware
+	static void setGlobalThreadCount(unsigned threadCount);
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+private:
+	std::vector<std::unique_ptr<Queue>> m_Queues;
+	std::vector<std::thread> m_Threads;
+
+	std::atomic<bool> m_Stop;
+	std::atomic<int> m_PendingTasks;
+	std::atomic<unsigned> m_NextQueue;
+
+	std::mutex m_SleepMutex;
+	std::condition_variable m_WakeUp;
+
+	static unsigned s_GlobalThreadCount;
+	static std::atomic<bool> s_GlobalCreated;
+
+	void workerLoop(unsigned index);
+	bool takeTask(unsigned index, Task& task);
+};
+
+// Tracks a set of tasks submitted to a pool. Waiting runs queued tasks on
+// the waiting thread, so tasks may wait on groups of their own.
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool& pool = ThreadPool::global());
+	~TaskGroup();
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	void run(ThreadPool::Task&& task);
+	void wait();
+
+private:
+	ThreadPool& m_Pool;
+	std::atomic<unsigned> m_Pending;
+};
+
+/// Calls function(begin, end) over consecutive chunks of [0, count) in parallel and waits for all of them
+template <typename Function>
+void parallelFor(size_t count, size_t chunkSize, const Function& function, ThreadPool& pool = ThreadPool::global())
+{
+	if (count <= chunkSize)
+	{
+		function(size_t(0), count);
+		return;
+	}
+
+	TaskGroup group(pool);
+	for (size_t begin = chunkSize; begin < count; begin += chunkSize)
+	{
+		const size_t end = std::min(begin + chunkSize, count);
+		group.run([&function, begin, end]() { function(begin, end); });
+	}
+
+	function(size_t(0), chunkSize);
+	group.wait();
+}
+
+#endif // !THREAD_POOL_H
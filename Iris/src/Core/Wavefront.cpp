@@ -0,0 +1,139 @@
+#include "Wavefront.h"
+
+#include <limits>
+#include <cassert>
+#include <algorithm>
+
+#include <Core/Scene.h>
+#include <Core/Renderer.h>
+#include <Objects/Material.h>
+
+Wavefront::Wavefront(const Scene& scene)
+	: m_Scene(scene)
+{
+}
+
+void Wavefront::reset(unsigned pixelCount)
+{
+	m_Rays.clear();
+	m_NextRays.clear();
+	m_ShadowRays.clear();
+	m_Hits.clear();
+	m_Pixels.assign(pixelCount, Color());
+}
+
+void Wavefront::trace()
+{
+	while (!m_NextRays.empty())
+	{
+		const size_t batchStart = m_NextRays.size() - std::min(m_NextRays.size(), s_BatchSize);
+		m_Rays.assign(m_NextRays.begin() + batchStart, m_NextRays.end());
+		m_NextRays.erase(m_NextRays.begin() + batchStart, m_NextRays.end());
+
+		extend();
+		shade();
+		traceShadowRays();
+	}
+}
+
+bool Wavefront::batchFull() const
+{
+	return m_NextRays.size() >= s_BatchSize;
+}
+
+void Wavefront::addCameraRay(const Ray& ray, unsigned pixel)
+{
+	addRay(ray, Color(1.0f, 1.0f, 1.0f), pixel);
+}
+
+void Wavefront::addRay(const Ray& ray, const Color& weight, unsigned pixel)
+{
+	assert(pixel < m_Pixels.size());
+	if (ray.depth() < Renderer::maxDepth())
+		m_NextRays.push_back({ ray, weight, pixel });
+}
+
+void Wavefront::addShadowRay(const Ray& ray, float minT, float maxT, const Color& contribution, unsigned pixel)
+{
+	assert(pixel < m_Pixels.size());
+	m_ShadowRays.push_back({ ray, minT, maxT, contribution, pixel });
+}
+
+void Wavefront::addColor(unsigned pixel, const Color& color)
+{
+	assert(pixel < m_Pixels.size());
+	m_Pixels[pixel] += color;
+}
+
+const Color& Wavefront::pixel(unsigned pixel) const
+{
+	return m_Pixels[pixel];
+}
+
+const Scene& Wavefront::scene() const
+{
+	return m_Scene;
+}
+
+// Rays that miss everything pick up the background right away
+void Wavefront::extend()
+{
+	m_Hits.clear();
+	for (const PathRay& path : m_Rays)
+	{
+		Surface::Context context;
+		if (m_Scene.isHit(path.ray, context, 0.000001f, std::numeric_limits<float>::max()))
+			m_Hits.push_back({ context.material, path, context });
+		else
+			addColor(path.pixel, path.weight * m_Scene.settings().background.getColor(path.ray));
+	}
+}
+
+// Hits of one material are shaded together, so the material's code and
+// data stay in cache for the whole run
+void Wavefront::shade()
+{
+	// Hits are large, so their indices are sorted and each hit is moved only once
+	m_Order.resize(m_Hits.size());
+	for (unsigned i = 0; i < m_Order.size(); i++)
+		m_Order[i] = i;
+
+	std::sort(m_Order.begin(), m_Order.end(), [this](unsigned lhs, unsigned rhs)
+	{
+		const Material* lhsMaterial = m_Hits[lhs].material;
+		const Material* rhsMaterial = m_Hits[rhs].material;
+		return lhsMaterial < rhsMaterial || (lhsMaterial == rhsMaterial && lhs < rhs);
+	});
+
+	m_SortedHits.clear();
+	for (unsigned i : m_Order)
+		m_SortedHits.push_back(m_Hits[i]);
+
+	size_t first = 0;
+	while (first < m_SortedHits.size())
+	{
+		const Material* material = m_SortedHits[first].material;
+
+		size_t last = first + 1;
+		while (last < m_SortedHits.size() && m_SortedHits[last].material == material)
+			last++;
+
+		material->shadeWavefront(m_SortedHits.data() + first, last - first, *this);
+		first = last;
+	}
+
+	m_Hits.clear();
+}
+
+void Wavefront::traceShadowRays()
+{
+	for (const ShadowRay& shadowRay : m_ShadowRays)
+	{
+		if (!m_Scene.isOccluded(shadowRay.ray, shadowRay.minT, shadowRay.maxT))
+			addColor(shadowRay.pixel, shadowRay.contribution);
+	}
+
+	m_ShadowRays.clear();
+}
+
+constexpr size_t Wavefront::s_BatchSize;
@@ -0,0 +1,92 @@
+#ifndef WAVEFRONT_H
+
+#define WAVEFRONT_H
+
+#include <vector>
+#include <Core/Ray.h>
+#include <Containers/Color.h>
+#include <Objects/Surface.h>
+
+class Scene;
+class Material;
+
+// Ray state of the wavefront renderer. Instead of following every path
+// recursively, all rays of a batch go through the same stage before the
+// next one starts: extend (find the closest hits), sort the hits by
+// material, shade them, then trace the shadow rays shading asked for.
+// Shading does not trace anything itself, it adds the color a hit
+// contributes to its pixel and queues the rays that color depends on,
+// weighted by how much they contribute. The next iteration extends those.
+//
+// An iteration extends at most s_BatchSize rays, taking the most recently
+// queued ones first, so a path's deeper rays run before new ones start.
+// Every depth then leaves at most s_BatchSize rays waiting, which bounds the
+// queued rays by (max depth + 1) * s_BatchSize no matter how often shading
+// branches, and the hits and their contexts by s_BatchSize.
+class Wavefront
+{
+public:
+	static constexpr size_t s_BatchSize = 4096;
+
+public:
+	// A ray of a path, weight scales whatever color it brings back
+	struct PathRay
+	{
+		Ray ray;
+		Color weight;
+		unsigned pixel;
+	};
+
+	// Adds contribution to the pixel unless something lies on the ray between minT and maxT
+	struct ShadowRay
+	{
+		Ray ray;
+		float minT;
+		float maxT;
+		Color contribution;
+		unsigned pixel;
+	};
+
+	struct Hit
+	{
+		const Material* material;
+		PathRay path;
+		Surface::Context context;
+	};
+
+public:
+	explicit Wavefront(const Scene& scene);
+
+	/// Clears the pixels and every queue for a new batch of pixelCount pixels
+	void reset(unsigned pixelCount);
+	/// Runs the stages until no ray is left
+	void trace();
+	/// A full batch of rays is queued, callers trace them before adding more camera rays
+	bool batchFull() const;
+
+	void addCameraRay(const Ray& ray, unsigned pixel);
+	/// Queues a ray for the next extend stage, rays past the renderer's max depth are dropped
+	void addRay(const Ray& ray, const Color& weight, unsigned pixel);
+	void addShadowRay(const Ray& ray, float minT, float maxT, const Color& contribution, unsigned pixel);
+	void addColor(unsigned pixel, const Color& color);
+
+	/// Sum of all colors added to the pixel
+	const Color& pixel(unsigned pixel) const;
+	const Scene& scene() const;
+
+private:
+	const Scene& m_Scene;
+	std::vector<PathRay> m_Rays;
+	std::vector<PathRay> m_NextRays;
+	std::vector<ShadowRay> m_ShadowRays;
+	std::vector<Hit> m_Hits;
+	std::vector<Hit> m_SortedHits;
+	std::vector<unsigned> m_Order;
+	std::vector<Color> m_Pixels;
+
+	void extend();
+	void shade();
+	void traceShadowRays();
+};
+
+#endif // !WAVEFRONT_H
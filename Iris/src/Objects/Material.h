@@ -5,6 +5,7 @@
 #include <Containers/Color.h>
 #include <Objects/Surface.h>
 #include <Core/Scene.h>
+#include <Core/Wavefront.h>
 #include <Core/Ray.h>
 
 class Material
@@ -15,6 +16,14 @@ public:
 	virtual ~Material() {}
 
 	virtual Color shadeScene(const Ray& ray, const Scene& scene, const Surface::Context& context) const = 0;
+	/// Wavefront counterpart of shadeScene, called with all hits of this material in the current batch.
+	/// Rather than tracing rays, hits add their color to the wavefront and queue the rays it depends on.
+	/// Materials that do not override it shade each hit recursively with shadeScene
+	virtual void shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const
+	{
+		for (size_t i = 0; i < count; i++)
+			wavefront.addColor(hits[i].path.pixel, hits[i].path.weight * shadeScene(hits[i].path.ray, wavefront.scene(), hits[i].context));
+	}
 	virtual bool hasShadow() const { return true; }
 	bool hasBackfaceCulling() const { return m_BackfaceCulling; }
 
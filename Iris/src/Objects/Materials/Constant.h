@@ -9,6 +9,11 @@ class Constant : public Material
 public:
 	Constant(const Color& albedo, bool smoothShading, bool backfaceCulling) : Material(albedo, smoothShading, backfaceCulling) {}
 	virtual Color shadeScene(const Ray& ray, const Scene& scene, const Surface::Context& context) const override { return m_Albedo; }
+	virtual void shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const override
+	{
+		for (size_t i = 0; i < count; i++)
+			wavefront.addColor(hits[i].path.pixel, hits[i].path.weight * m_Albedo);
+	}
 };
 
 #endif // !CONSTANT_H
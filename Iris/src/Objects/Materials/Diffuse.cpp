@@ -43,69 +43,102 @@ Vector3f Diffuse::diffuseReflect() const
 	return rotationMatrix * rayDirection;
 }
 
-Color Diffuse::calculateDirectLight(const Ray& ray, const Scene& scene, const Surface::Context& context) const
+void Diffuse::shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const
 {
+	const Scene& scene = wavefront.scene();
 	const std::vector<Light>& lights = scene.lights();
 
-	Color accumulatedColor;
-	for (const Light& light : lights)
+	const bool indirectLight = scene.settings().flags.globalIllumination;
+	const bool directLight = !indirectLight || !lights.empty();
+	// With both terms shadeScene averages them
+	const float scale = directLight && indirectLight ? 0.5f : 1.0f;
+
+	for (size_t i = 0; i < count; i++)
 	{
-		const Point3f& hitPoint = m_SmoothShading ? context.smoothHitPoint : context.hitPoint;
-		const Vector3f& normal = m_SmoothShading ? context.normal : context.faceNormal;
+		const Wavefront::Hit& hit = hits[i];
+		const Color weight = hit.path.weight * scale;
 
-		Vector3f lightDir = light.position() - hitPoint;
-		const float sphereRadius = lightDir.length();
+		if (directLight)
+		{
+			for (const Light& light : lights)
+			{
+				LightSample sample;
+				if (sampleLight(light, hit.context, sample))
+					wavefront.addShadowRay(Ray(sample.origin, sample.direction), 0.0001f, sample.distance, weight * (sample.reduction * m_Albedo), hit.path.pixel);
+			}
+		}
 
-		lightDir.normalize();
+		if (indirectLight && hit.path.ray.depth() < m_LightDepth)
+			wavefront.addRay(indirectRay(hit.path.ray, hit.context), weight * m_Albedo, hit.path.pixel);
+	}
+}
 
-		// Lambert's cosine law
-		const float angleOffset = dotProduct(lightDir, normal);
+bool Diffuse::sampleLight(const Light& light, const Surface::Context& context, LightSample& sample) const
+{
+	const Point3f& hitPoint = m_SmoothShading ? context.smoothHitPoint : context.hitPoint;
+	const Vector3f& normal = m_SmoothShading ? context.normal : context.faceNormal;
 
-		if (angleOffset <= 0.0f) continue;
+	Vector3f lightDir = light.position() - hitPoint;
+	const float sphereRadius = lightDir.length();
 
-		bool isInShadow = false;
-		const float biasFactor = m_SmoothShading ? 0.01f : 0.1f;
-		const Vector3f bias = normal * biasFactor;
-		const Ray shadowRay(hitPoint + bias, lightDir);
+	lightDir.normalize();
 
-		Surface::Context tempContext;
-		const float closestObject = sphereRadius;
-		for (const std::unique_ptr<Surface>& object : scene.objects())
-		{
-			if (object->isHit(shadowRay, tempContext, 0.0001f, closestObject))
-			{
-				if (!tempContext.material->hasShadow())
-					continue;
+	// Lambert's cosine law
+	const float angleOffset = dotProduct(lightDir, normal);
 
-				isInShadow = true;
-				break;
-			}
-		}
+	if (angleOffset <= 0.0f)
+		return false;
 
-		if (isInShadow) continue;
+	const float biasFactor = m_SmoothShading ? 0.01f : 0.1f;
+	const Vector3f bias = normal * biasFactor;
 
-		const float sphereArea = 4.0f * PI * sphereRadius * sphereRadius;
-		const float& reduction = light.intensity() / sphereArea * angleOffset;
+	const float sphereArea = 4.0f * PI * sphereRadius * sphereRadius;
 
-		accumulatedColor += reduction * m_Albedo;
+	sample.origin = hitPoint + bias;
+	sample.direction = lightDir;
+	sample.distance = sphereRadius;
+	sample.reduction = light.intensity() / sphereArea * angleOffset;
+	return true;
+}
+
+Color Diffuse::calculateDirectLight(const Ray& ray, const Scene& scene, const Surface::Context& context) const
+{
+	const std::vector<Light>& lights = scene.lights();
+
+	Color accumulatedColor;
+	for (const Light& light : lights)
+	{
+		LightSample sample;
+		if (!sampleLight(light, context, sample))
+			continue;
+
+		const Ray shadowRay(sample.origin, sample.direction);
+
+		if (scene.isOccluded(shadowRay, 0.0001f, sample.distance))
+			continue;
+
+		accumulatedColor += sample.reduction * m_Albedo;
 	}
 
 	return accumulatedColor;
 }
 
-Color Diffuse::calculateIndirectLight(const Ray& ray, const Scene& scene, const Surface::Context& context) const
+Ray Diffuse::indirectRay(const Ray& ray, const Surface::Context& context) const
 {
-	if (ray.depth() >= m_LightDepth)
-		return Color();
-
 	Vector3f rayDirection = diffuseReflect();
 	const Matrix3 localCoordinateSystem = constructLocalCoordinateSystem(context.hitPoint, ray.direction(), context.faceNormal);
 	rayDirection = localCoordinateSystem * rayDirection;
 	const Point3f origin = context.hitPoint + context.faceNormal * 0.001f;
 
-	Ray reflectedRay(origin, rayDirection, ray.depth() + 1);
+	return Ray(origin, rayDirection, ray.depth() + 1);
+}
+
+Color Diffuse::calculateIndirectLight(const Ray& ray, const Scene& scene, const Surface::Context& context) const
+{
+	if (ray.depth() >= m_LightDepth)
+		return Color();
 
-	return m_Albedo * Renderer::traceRay(reflectedRay, scene);
+	return m_Albedo * Renderer::traceRay(indirectRay(ray, context), scene);
 }
 
 Color Diffuse::calculateIndirectLightAlt(const Ray& ray, const Scene& scene, const Surface::Context& context) const
@@ -10,11 +10,24 @@ public:
 	Diffuse(Color albedo, bool smoothShading = true, bool backfaceCulling = false);
 	Diffuse(Color albedo, unsigned lightDepth, bool smoothShading, bool backfaceCulling);
 	virtual Color shadeScene(const Ray& ray, const Scene& scene, const Surface::Context& context) const override;
+	virtual void shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const override;
 
 private:
+	// What a light adds to a hit point, provided the shadow ray reaches it
+	struct LightSample
+	{
+		Point3f origin;
+		Vector3f direction;
+		float distance;
+		float reduction;
+	};
+
 	unsigned m_LightDepth;
 
 	Vector3f diffuseReflect() const;
+	/// Fails if the light is behind the surface
+	bool sampleLight(const Light& light, const Surface::Context& context, LightSample& sample) const;
+	Ray indirectRay(const Ray& ray, const Surface::Context& context) const;
 	Color calculateDirectLight(const Ray& ray, const Scene& scene, const Surface::Context& context) const;
 	Color calculateIndirectLight(const Ray& ray, const Scene& scene, const Surface::Context& context) const;
 	Color calculateIndirectLightAlt(const Ray& ray, const Scene& scene, const Surface::Context& context) const; // Alternative algorithm for indirect light
@@ -11,6 +11,12 @@ public:
 		: Material(albedo, smoothShading, backfaceCulling), m_Intensity(std::max(intensity, 0.0f)) {}
 
 	virtual Color shadeScene(const Ray& ray, const Scene& scene, const Surface::Context& context) const override { return m_Albedo * m_Intensity; }
+	virtual void shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const override
+	{
+		const Color emitted = m_Albedo * m_Intensity;
+		for (size_t i = 0; i < count; i++)
+			wavefront.addColor(hits[i].path.pixel, hits[i].path.weight * emitted);
+	}
 
 private:
 	float m_Intensity;
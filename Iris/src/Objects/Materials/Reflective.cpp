@@ -18,6 +18,27 @@ Color Reflective::shadeScene(const Ray& ray, const Scene& scene, const Surface::
     if (!scene.settings().flags.reflections)
         return m_Albedo;
 
+    Color reflectedColor = Renderer::traceRay(reflectionRay(ray, context), scene);
+
+    return m_Albedo * m_ReflectionIndex * reflectedColor;
+}
+
+void Reflective::shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const
+{
+    const bool reflections = wavefront.scene().settings().flags.reflections;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const Wavefront::Hit& hit = hits[i];
+        if (reflections)
+            wavefront.addRay(reflectionRay(hit.path.ray, hit.context), hit.path.weight * (m_Albedo * m_ReflectionIndex), hit.path.pixel);
+        else
+            wavefront.addColor(hit.path.pixel, hit.path.weight * m_Albedo);
+    }
+}
+
+Ray Reflective::reflectionRay(const Ray& ray, const Surface::Context& context) const
+{
     const Vector3f& normal = m_SmoothShading ? context.normal : context.faceNormal;
     const Vector3f& hitPoint = m_SmoothShading ? context.smoothHitPoint : context.hitPoint;
     const Vector3f& rayDir = ray.direction();
@@ -25,8 +46,5 @@ Color Reflective::shadeScene(const Ray& ray, const Scene& scene, const Surface::
     const float biasFactor = 0.1f;
     const Vector3f bias = normal * biasFactor;
     const Vector3f reflectionDir = toUnitVector(vecReflect(rayDir, normal) + m_Roughness * randomVector(-0.5f, 0.5f));
-    const Ray reflectionRay(hitPoint + bias, reflectionDir, ray.depth() + 1);
-    Color reflectedColor = Renderer::traceRay(reflectionRay, scene);
-
-    return m_Albedo * m_ReflectionIndex * reflectedColor;
+    return Ray(hitPoint + bias, reflectionDir, ray.depth() + 1);
 }
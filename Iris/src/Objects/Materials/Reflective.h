@@ -10,10 +10,13 @@ public:
 	Reflective(const Color& albedo, float reflectionIndex, bool smoothShading = true, bool backfaceCulling = false);
 	Reflective(const Color& albedo, float reflectionIndex, float roughness, bool smoothShading = true, bool backfaceCulling = false);
 	virtual Color shadeScene(const Ray& ray, const Scene& scene, const Surface::Context& context) const override;
+	virtual void shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const override;
 
 private:
 	float m_Roughness;
 	float m_ReflectionIndex;
+
+	Ray reflectionRay(const Ray& ray, const Surface::Context& context) const;
 };
 
 
@@ -9,6 +9,51 @@ Refractive::Refractive(const Color albedo, float refractionIndex, bool smoothSha
 }
 
 Color Refractive::shadeScene(const Ray& ray, const Scene& scene, const Surface::Context& context) const
+{
+    const Interaction interaction = interact(ray, context);
+    const float reflectance = interaction.reflectance;
+
+    Color refractedColor, reflectedColor;
+
+    if (reflectance < 1.0f)
+    {
+        refractedColor = scene.settings().flags.refractions ? 
+            Renderer::traceRay(interaction.refractedRay, scene) : m_Albedo;
+    }
+
+    reflectedColor = scene.settings().flags.reflections ? 
+        Renderer::traceRay(interaction.reflectedRay, scene) : m_Albedo;
+
+    return interaction.attenuation * (reflectedColor * reflectance + refractedColor * (1 - reflectance));
+}
+
+void Refractive::shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const
+{
+    const SceneSettings& settings = wavefront.scene().settings();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const Wavefront::Hit& hit = hits[i];
+        const Interaction interaction = interact(hit.path.ray, hit.context);
+        const float reflectance = interaction.reflectance;
+        const Color weight = hit.path.weight * interaction.attenuation;
+
+        if (reflectance < 1.0f)
+        {
+            if (settings.flags.refractions)
+                wavefront.addRay(interaction.refractedRay, weight * (1 - reflectance), hit.path.pixel);
+            else
+                wavefront.addColor(hit.path.pixel, weight * (m_Albedo * (1 - reflectance)));
+        }
+
+        if (settings.flags.reflections)
+            wavefront.addRay(interaction.reflectedRay, weight * reflectance, hit.path.pixel);
+        else
+            wavefront.addColor(hit.path.pixel, weight * (m_Albedo * reflectance));
+    }
+}
+
+Refractive::Interaction Refractive::interact(const Ray& ray, const Surface::Context& context) const
 {
     const Vector3f& rayDir = ray.direction();
     const Point3f& hitPoint = m_SmoothShading ? context.smoothHitPoint : context.hitPoint;
@@ -44,26 +89,22 @@ Color Refractive::shadeScene(const Ray& ray, const Scene& scene, const Surface::
     const float eta = etai / etat;
     const float reflectance = fresnel(cosTheta_i, eta);
 
-    Color refractedColor, reflectedColor;
     const Color attenuatedColor = attenuation(rayDir, context.faceNormal, context.distance); // < Beer's law
 
+    // Total internal reflection leaves no refracted ray, the reflected one is reused as a placeholder
+    const float biasFactor = 0.05f;
+    Vector3f bias = calculateBias(rayDir, context.faceNormal, biasFactor, false);
+    Ray reflectedRay(hitPoint + bias, vecReflect(rayDir, refrNormal), ray.depth() + 1);
+    Ray refractedRay = reflectedRay;
+
     if (reflectance < 1.0f)
     {
-        Vector3f bias = calculateBias(rayDir, context.faceNormal, 0.001f, true);
+        Vector3f refractionBias = calculateBias(rayDir, context.faceNormal, 0.001f, true);
         Vector3f refraction = vecRefract(rayDir, refrNormal, cosTheta_i, eta);
-        Ray refractedRay(context.hitPoint + bias, refraction, ray.depth() + 1);
-
-        refractedColor = scene.settings().flags.refractions ? 
-            Renderer::traceRay(refractedRay, scene) : m_Albedo;
+        refractedRay = Ray(context.hitPoint + refractionBias, refraction, ray.depth() + 1);
     }
 
-    const float biasFactor = 0.05f;
-    Vector3f bias = calculateBias(rayDir, context.faceNormal, biasFactor, false);
-    Ray reflectedRay(hitPoint + bias, vecReflect(rayDir, refrNormal), ray.depth() + 1);
-    reflectedColor = scene.settings().flags.reflections ? 
-        Renderer::traceRay(reflectedRay, scene) : m_Albedo;
-
-    return attenuatedColor * (reflectedColor * reflectance + refractedColor * (1 - reflectance));
+    return { attenuatedColor, reflectance, reflectedRay, refractedRay };
 }
 
 float Refractive::fresnel(float cosTheta_i, float eta) const
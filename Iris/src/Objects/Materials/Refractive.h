@@ -9,11 +9,23 @@ class Refractive : public Material
 public:
 	Refractive(const Color albedo, float refractionIndex, bool smoothShading = true, bool backfaceCulling = false);
 	virtual Color shadeScene(const Ray& ray, const Scene& scene, const Surface::Context& context) const override;
+	virtual void shadeWavefront(const Wavefront::Hit* hits, size_t count, Wavefront& wavefront) const override;
 	virtual bool hasShadow() const { return false; }
 
 private:
+	// The rays leaving a hit and how much each of them contributes
+	struct Interaction
+	{
+		Color attenuation;
+		float reflectance;
+		Ray reflectedRay;
+		Ray refractedRay; // < Only valid while reflectance < 1
+	};
+
 	float m_RefractionIndex;
 
+	Interaction interact(const Ray& ray, const Surface::Context& context) const;
+
 	float fresnel(float cosTheta_i, float eta) const;
 	Color attenuation(const Vector3f& rayDirection, const Vector3f& normal, float distance) const;
 	Vector3f calculateBias(const Vector3f& dir, const Vector3f& normal, float bias, bool refracting) const;
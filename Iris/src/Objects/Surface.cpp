@@ -2,6 +2,37 @@
 
 #include <Utilities/Utility.h>
 
+bool Surface::isHit(const Ray& ray, Context& context, float minT, float maxT) const
+{
+	Hit hit;
+	if (!intersect(ray, hit, minT, maxT))
+		return false;
+
+	computeContext(ray, hit, context);
+	return true;
+}
+
+bool Surface::isOccluded(const Ray& ray, float minT, float maxT) const
+{
+	Hit hit;
+	return intersect(ray, hit, minT, maxT);
+}
+
+int Surface::intersectPacket(const RayPacket& packet, int activeMask, Hit hits[RayPacket::s_Size], float minT, float maxT[RayPacket::s_Size]) const
+{
+	int hitMask = 0;
+	for (int lane = 0; lane < RayPacket::s_Size; lane++)
+	{
+		if ((activeMask & (1 << lane)) != 0 && intersect(*packet.rays[lane], hits[lane], minT, maxT[lane]))
+		{
+			maxT[lane] = hits[lane].distance;
+			hitMask |= 1 << lane;
+		}
+	}
+
+	return hitMask;
+}
+
 void Surface::rotateX(float degrees)
 {
 	const float rad = fromDegreesToRadians(degrees);
@@ -4,6 +4,7 @@
 
 #include <Core/Ray.h>
 #include <Core/AABB.h>
+#include <Core/RayPacket.h>
 #include <Containers/Color.h>
 #include <Containers/Matrix4.h>
 
@@ -23,14 +24,33 @@ public:
 		const Material* material{}; // Material
 	};
 
+	// The minimum recorded while searching for the closest intersection,
+	// the full Context is only computed from it once the search is over
+	struct Hit
+	{
+		float distance{};			// The distance from the ray origin
+		int primitive{};			// Surface specific primitive index
+		Point2f barycentrics{};		// Barycentric coordinates on the primitive
+		const Surface* surface{};	// The surface that was hit
+	};
+
 public:
 	virtual ~Surface() {}
-	virtual bool isHit(const Ray& ray, Context& context, float minT, float maxT) const = 0;
+	virtual bool intersect(const Ray& ray, Hit& hit, float minT, float maxT) const = 0;
+	virtual void computeContext(const Ray& ray, const Hit& hit, Context& context) const = 0;
+	virtual bool isOccluded(const Ray& ray, float minT, float maxT) const;
+	/// Closest hits of the packet's active rays, each ray is searched up to its own maxT, which is lowered
+	/// to the distance of its hit. Returns the mask of rays that hit. Surfaces without a packet
+	/// traversal of their own intersect the rays one at a time
+	virtual int intersectPacket(const RayPacket& packet, int activeMask, Hit hits[RayPacket::s_Size], float minT, float maxT[RayPacket::s_Size]) const;
 	virtual void applyTransformations() = 0;
 	virtual std::unique_ptr<Surface> clone() const = 0;
 
-	Point3f position() const    { return m_Position; }
-	const AABB& getAABB() const { return m_AABB; }
+	bool isHit(const Ray& ray, Context& context, float minT, float maxT) const;
+
+	Point3f position() const          { return m_Position; }
+	const AABB& getAABB() const       { return m_AABB; }
+	const Material* material() const  { return m_Material.get(); }
 
 	void setMaterial(std::shared_ptr<Material> material) { m_Material = material; }
 
@@ -0,0 +1,83 @@
+#include "Instance.h"
+
+#include <cassert>
+#include <Objects/Material.h>
+
+Instance::Instance(const std::shared_ptr<const Mesh>& mesh, const std::shared_ptr<Material>& material, const Matrix3& transformation, const Point3f& position)
+	: Surface(material, mesh->getAABB()), m_Mesh(mesh)
+{
+	assert(m_Mesh);
+	m_TransformationMatrix = transformation;
+	m_Position = position;
+	applyTransformations();
+}
+
+// The direction is not normalized in object space, so distances along the
+// ray stay the same in both spaces and hits can be compared across surfaces.
+// The shared mesh was built with another object's material, culling follows this one's
+bool Instance::intersect(const Ray& ray, Hit& hit, float minT, float maxT) const
+{
+	if (!m_Mesh->intersect(toObjectSpace(ray), hit, minT, maxT, m_Material->hasBackfaceCulling()))
+		return false;
+
+	hit.surface = this;
+	return true;
+}
+
+void Instance::computeContext(const Ray& ray, const Hit& hit, Context& context) const
+{
+	m_Mesh->computeContext(toObjectSpace(ray), hit, context);
+
+	context.hitPoint = ray.at(hit.distance);
+	context.smoothHitPoint = m_TransformationMatrix * context.smoothHitPoint + m_Position;
+	context.normal = toUnitVector(m_NormalTransformation3 * context.normal);
+	context.faceNormal = toUnitVector(m_NormalTransformation3 * context.faceNormal);
+	context.material = m_Material.get();
+}
+
+bool Instance::isOccluded(const Ray& ray, float minT, float maxT) const
+{
+	return m_Mesh->isOccluded(toObjectSpace(ray), minT, maxT, m_Material->hasBackfaceCulling());
+}
+
+void Instance::applyTransformations()
+{
+	// invert() builds the inverse from the columns' cross products, which
+	// places them as columns and yields the inverse transpose
+	m_NormalTransformation3 = invert(m_TransformationMatrix);
+	m_InverseTransformation3 = transpose(m_NormalTransformation3);
+	constructAABB();
+}
+
+std::unique_ptr<Surface> Instance::clone() const
+{
+	return std::make_unique<Instance>(*this);
+}
+
+const std::shared_ptr<const Mesh>& Instance::mesh() const
+{
+	return m_Mesh;
+}
+
+Ray Instance::toObjectSpace(const Ray& ray) const
+{
+	return Ray(m_InverseTransformation3 * (ray.origin() - m_Position), m_InverseTransformation3 * ray.direction(), ray.depth());
+}
+
+// The world box encloses the eight transformed corners of the mesh's box
+void Instance::constructAABB()
+{
+	const AABB& meshAABB = m_Mesh->getAABB();
+
+	m_AABB = AABB();
+	for (int corner = 0; corner < 8; corner++)
+	{
+		const Point3f point(
+			(corner & 1) ? meshAABB.max().x() : meshAABB.min().x(),
+			(corner & 2) ? meshAABB.max().y() : meshAABB.min().y(),
+			(corner & 4) ? meshAABB.max().z() : meshAABB.min().z()
+		);
+
+		m_AABB.combine(m_TransformationMatrix * point + m_Position);
+	}
+}
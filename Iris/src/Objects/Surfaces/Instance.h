@@ -0,0 +1,34 @@
+#ifndef INSTANCE_H
+
+#define INSTANCE_H
+
+#include <Objects/Surface.h>
+#include <Objects/Surfaces/Mesh.h>
+#include <Containers/Matrix3.h>
+
+// Places a mesh in the scene without copying it. The geometry and BVH are
+// shared between every instance of the mesh, rays are moved into the mesh's
+// object space instead of the mesh being moved into the world.
+class Instance : public Surface
+{
+public:
+	Instance(const std::shared_ptr<const Mesh>& mesh, const std::shared_ptr<Material>& material, const Matrix3& transformation = Matrix3(), const Point3f& position = Point3f());
+
+	virtual bool intersect(const Ray& ray, Hit& hit, float minT, float maxT) const override;
+	virtual void computeContext(const Ray& ray, const Hit& hit, Context& context) const override;
+	virtual bool isOccluded(const Ray& ray, float minT, float maxT) const override;
+	virtual void applyTransformations() override;
+	virtual std::unique_ptr<Surface> clone() const override;
+
+	const std::shared_ptr<const Mesh>& mesh() const;
+
+private:
+	std::shared_ptr<const Mesh> m_Mesh;
+	Matrix3 m_InverseTransformation3;
+	Matrix3 m_NormalTransformation3; // < Inverse transpose of the transformation
+
+	Ray toObjectSpace(const Ray& ray) const;
+	void constructAABB();
+};
+
+#endif // !INSTANCE_H
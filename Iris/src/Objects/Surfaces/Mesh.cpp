@@ -1,78 +1,306 @@
 #include "Mesh.h"
 
-#include <stack>
-#include <thread>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <Utilities/Timer.h>
 #include <Utilities/Utility.h>
+#include <Utilities/MappedFile.h>
 
 #include <Objects/Materials/Diffuse.h>
 
 unsigned Mesh::s_MaxTreeDepth = 30;
+float Mesh::s_RebuildThreshold = 1.5f;
+float Mesh::s_SpatialSplitBudget = 0.3f;
+bool Mesh::s_Mailboxing = false;
+std::string Mesh::s_CacheDirectory;
+bool Mesh::s_CompressNodes = false;
+Mesh::SplitMethod Mesh::s_SplitMethod = Mesh::SplitMethod::SAH;
 
 Mesh::Mesh(const char* objFile, const std::shared_ptr<Material>& material)
-	: Surface(material, AABB(Vector3f(), Vector3f())), m_MaxTrianglesPerLeaf(15)
+	: Surface(material, AABB(Vector3f(), Vector3f())), m_MaxTrianglesPerLeaf(15), m_SplitMethod(s_SplitMethod), m_BuildCost(0.0f)
 {
 	assert(objFile);
 	loadObj(objFile);
-	calculateVertexNormals();
 	constructAABB();
-	constructBVH();
+	constructCachedBVH();
 }
 
 Mesh::Mesh(std::vector<Vector3f>&& vertexBuffer, std::vector<Vector3i>&& indexBuffer, const std::shared_ptr<Material>& material)
-	: Surface(material, AABB(Vector3f(), Vector3f())), m_MaxTrianglesPerLeaf(15)
+	: Surface(material, AABB(Vector3f(), Vector3f())), m_MaxTrianglesPerLeaf(15), m_SplitMethod(s_SplitMethod), m_BuildCost(0.0f)
 {
 	std::swap(m_VertexBuffer, vertexBuffer);
 	std::swap(m_IndexBuffer, indexBuffer);
-	calculateVertexNormals();
 	constructAABB();
-	constructBVH();
+	constructCachedBVH();
+}
+
+bool Mesh::intersect(const Ray& ray, Hit& hit, float minT, float maxT) const
+{
+	return traverse(ray, minT, maxT, false, m_Material->hasBackfaceCulling(), hit);
+}
+
+bool Mesh::intersect(const Ray& ray, Hit& hit, float minT, float maxT, bool culling) const
+{
+	return traverse(ray, minT, maxT, false, culling, hit);
+}
+
+bool Mesh::isOccluded(const Ray& ray, float minT, float maxT) const
+{
+	return isOccluded(ray, minT, maxT, m_Material->hasBackfaceCulling());
 }
 
-bool Mesh::isHit(const Ray& ray, Context& context, float minT, float maxT) const
+bool Mesh::isOccluded(const Ray& ray, float minT, float maxT, bool culling) const
 {
-	if (!m_AABB.isHit(ray, maxT, maxT))
+	Hit hit;
+	return traverse(ray, minT, maxT, true, culling, hit);
+}
+
+// With anyHit set the traversal stops at the first intersection found,
+// which is then not necessarily the closest one
+bool Mesh::traverse(const Ray& ray, float minT, float maxT, bool anyHit, bool culling, Hit& hit) const
+{
+	float entryT;
+	if (!m_AABB.entryDistance(ray, maxT, entryT))
 		return false;
 
-	std::stack<const BVHNode*> nodes;
-	const BVHNode* root = m_BVH.root();
-	nodes.push(root);
+	const BVH::StackEntry root = { 0, 0, entryT };
+	if (m_BVH.quantized())
+		return traverseNodes(m_BVH.quantizedNodes().data(), ray, root, minT, maxT, anyHit, culling, hit);
+
+	return traverseNodes(m_BVH.nodes().data(), ray, root, minT, maxT, anyHit, culling, hit);
+}
+
+template<typename Node>
+bool Mesh::traverseNodes(const Node* bvhNodes, const Ray& ray, const BVH::StackEntry& start, float minT, float maxT, bool anyHit, bool culling, Hit& hit) const
+{
+	const BVH::SIMDRay simdRay(ray);
+
+	BVH::StackEntry stack[BVH::s_MaxStackSize];
+	stack[0] = start;
+	unsigned stackSize = 1;
+
+	unsigned nodesVisited = 0;
+	unsigned primitiveTests = 0;
+	unsigned mailboxHits = 0;
+
+	// Builders that duplicate straddling triangles let one ray reach the same
+	// triangle from several leaves. A small direct mapped mailbox of recently
+	// tested indices catches most repeats, a collision only costs a retest.
+	// Padding lanes (-1) never enter it, they are neither tested nor counted.
+	constexpr int mailboxSize = 32;
+	const bool mailboxing = s_Mailboxing && (m_SplitMethod == SplitMethod::SpatialMedian || m_SplitMethod == SplitMethod::SBVH);
+	int mailbox[mailboxSize];
+	if (mailboxing)
+		std::fill(mailbox, mailbox + mailboxSize, -1);
 
 	bool isHit = false;
+	float closestT = maxT;
+	int hitTriangle = -1;
+	float hitU = 0.0f, hitV = 0.0f;
 
-	float innerMaxT = std::numeric_limits<float>::max();
-	while (!nodes.empty())
+	while (stackSize > 0)
 	{
-		root = nodes.top();
-		nodes.pop();
+		const BVH::StackEntry entry = stack[--stackSize];
+
+		// Nodes entered beyond the closest hit found so far can not contain a closer one
+		if (entry.entryT > closestT)
+			continue;
 
-		float temp;
-		if (root->AABB.isHit(ray, maxT, temp))
+		if (entry.count != 0)
 		{
-			if (!root->value.empty())
+			if (!mailboxing)
+				primitiveTests += entry.count;
+
+			const unsigned firstBlock = entry.child / BVH::s_Width;
+			const unsigned lastBlock = (entry.child + entry.count + BVH::s_Width - 1) / BVH::s_Width;
+
+			for (unsigned i = firstBlock; i < lastBlock; i++)
 			{
-				for (int triangleIndex : root->value)
+				const TriangleBlock& block = m_TriangleBlocks[i];
+
+				int testMask = (1 << BVH::s_Width) - 1;
+				if (mailboxing)
 				{
-					if (rayTriangleIntersection(m_IndexBuffer[triangleIndex], ray, context, minT, innerMaxT, m_Material->hasBackfaceCulling()))
+					testMask = 0;
+					for (int lane = 0; lane < BVH::s_Width; lane++)
+					{
+						const int triangle = block.triangle[lane];
+						if (triangle < 0)
+							continue;
+
+						int& slot = mailbox[triangle & (mailboxSize - 1)];
+						const int isRepeat = slot == triangle;
+						slot = triangle;
+
+						testMask |= (isRepeat ^ 1) << lane;
+						primitiveTests += isRepeat ^ 1;
+						mailboxHits += isRepeat;
+					}
+
+					if (testMask == 0)
+						continue;
+				}
+
+				float t[BVH::s_Width], u[BVH::s_Width], v[BVH::s_Width];
+				const int hitMask = intersectTriangleBlock(block, simdRay, minT, closestT, culling, t, u, v) & testMask;
+
+				if (hitMask == 0)
+					continue;
+
+				for (int lane = 0; lane < BVH::s_Width; lane++)
+				{
+					if ((hitMask & (1 << lane)) != 0 && t[lane] <= closestT)
 					{
 						isHit = true;
-						innerMaxT = context.distance;
+						closestT = t[lane];
+						hitTriangle = block.triangle[lane];
+						hitU = u[lane];
+						hitV = v[lane];
 					}
 				}
+
+				if (anyHit)
+					break;
 			}
-			else
+
+			if (isHit && anyHit)
+				break;
+
+			continue;
+		}
+
+		nodesVisited++;
+		BVH::pushChildren(bvhNodes[entry.child], simdRay, closestT, stack, stackSize);
+	}
+
+	TraversalStats& stats = TraversalStats::threadLocal();
+	stats.nodesVisited += nodesVisited;
+	stats.primitiveTests += primitiveTests;
+	stats.mailboxHits += mailboxHits;
+
+	if (isHit)
+	{
+		hit.distance = closestT;
+		hit.primitive = hitTriangle;
+		hit.barycentrics = Point2f(hitU, hitV);
+		hit.surface = this;
+	}
+
+	return isHit;
+}
+
+int Mesh::intersectPacket(const RayPacket& packet, int activeMask, Hit hits[RayPacket::s_Size], float minT, float maxT[RayPacket::s_Size]) const
+{
+	float closestT[RayPacket::s_Size];
+	float entryT = std::numeric_limits<float>::max();
+	int mask = 0;
+	for (int lane = 0; lane < RayPacket::s_Size; lane++)
+	{
+		closestT[lane] = maxT[lane];
+
+		float t0 = 0.0f, t1 = maxT[lane];
+		if ((activeMask & (1 << lane)) != 0 && m_AABB.clipRay(*packet.rays[lane], t0, t1))
+		{
+			mask |= 1 << lane;
+			entryT = std::min(entryT, t0);
+		}
+	}
+
+	if (mask == 0)
+		return 0;
+
+	const bool culling = m_Material->hasBackfaceCulling();
+	const BVH::PacketStackEntry root = { 0, 0, entryT, mask };
+	const int hitMask = m_BVH.quantized()
+		? traversePacket(m_BVH.quantizedNodes().data(), packet, root, minT, closestT, culling, hits)
+		: traversePacket(m_BVH.nodes().data(), packet, root, minT, closestT, culling, hits);
+
+	for (int lane = 0; lane < RayPacket::s_Size; lane++)
+		maxT[lane] = closestT[lane];
+
+	return hitMask;
+}
+
+// Walks the tree once for all rays of the packet, a node is only visited by
+// the rays that entered it. Once a single ray is left in a subtree the rest
+// of it is traversed with the cheaper single ray routine. Mailboxing is not
+// used here, a triangle is tested against the whole packet at once.
+template<typename Node>
+int Mesh::traversePacket(const Node* bvhNodes, const RayPacket& packet, const BVH::PacketStackEntry& start, float minT, float closestT[RayPacket::s_Size], bool culling, Hit hits[RayPacket::s_Size]) const
+{
+	BVH::PacketStackEntry stack[BVH::s_MaxStackSize];
+	stack[0] = start;
+	unsigned stackSize = 1;
+
+	unsigned nodesVisited = 0;
+	unsigned primitiveTests = 0;
+	int hitMask = 0;
+
+	while (stackSize > 0)
+	{
+		const BVH::PacketStackEntry entry = stack[--stackSize];
+
+		// Rays that found a hit before the node's box can skip it, their entry is at least entry.entryT
+		const __m128 closest = _mm_loadu_ps(closestT);
+		const int mask = entry.mask & _mm_movemask_ps(_mm_cmpge_ps(closest, _mm_set1_ps(entry.entryT)));
+		if (mask == 0)
+			continue;
+
+		if (RayPacket::count(mask) == 1)
+		{
+			int lane = 0;
+			while ((mask & (1 << lane)) == 0)
+				lane++;
+
+			const BVH::StackEntry single = { entry.child, entry.count, entry.entryT };
+			if (traverseNodes(bvhNodes, *packet.rays[lane], single, minT, closestT[lane], false, culling, hits[lane]))
+			{
+				closestT[lane] = hits[lane].distance;
+				hitMask |= 1 << lane;
+			}
+			continue;
+		}
+
+		if (entry.count != 0)
+		{
+			primitiveTests += entry.count * RayPacket::count(mask);
+
+			const unsigned firstBlock = entry.child / BVH::s_Width;
+			const unsigned lastBlock = (entry.child + entry.count + BVH::s_Width - 1) / BVH::s_Width;
+
+			for (unsigned i = firstBlock; i < lastBlock; i++)
 			{
-				if (root->left != nullptr)
-					nodes.push(root->left);
+				const TriangleBlock& block = m_TriangleBlocks[i];
+				for (int triangle = 0; triangle < BVH::s_Width && block.triangle[triangle] != -1; triangle++)
+				{
+					float t[RayPacket::s_Size], u[RayPacket::s_Size], v[RayPacket::s_Size];
+					const int triangleHits = intersectTrianglePacket(block, triangle, packet, minT, closestT, culling, t, u, v) & mask;
 
-				if (root->right != nullptr)
-					nodes.push(root->right);
+					for (int lane = 0; lane < RayPacket::s_Size; lane++)
+					{
+						if ((triangleHits & (1 << lane)) != 0)
+						{
+							closestT[lane] = t[lane];
+							hits[lane] = { t[lane], block.triangle[triangle], Point2f(u[lane], v[lane]), this };
+							hitMask |= 1 << lane;
+						}
+					}
+				}
 			}
+
+			continue;
 		}
+
+		nodesVisited += RayPacket::count(mask);
+		BVH::pushChildren(bvhNodes[entry.child], packet, _mm_loadu_ps(closestT), mask, stack, stackSize);
 	}
 
-	return isHit;
+	TraversalStats& stats = TraversalStats::threadLocal();
+	stats.nodesVisited += nodesVisited;
+	stats.primitiveTests += primitiveTests;
+
+	return hitMask;
 }
 
 void Mesh::applyTransformations()
@@ -88,12 +316,30 @@ void Mesh::applyTransformations()
 		normal = transposedInvertedMatrix * normal;
 
 	constructAABB();
-	constructBVH();
+	refitBVH();
+}
+
+void Mesh::updateVertices(std::vector<Point3f>&& vertexBuffer)
+{
+	assert(vertexBuffer.size() == m_VertexBuffer.size());
+	std::swap(m_VertexBuffer, vertexBuffer);
+
+	calculateVertexNormals();
+	constructAABB();
+	refitBVH();
+}
+
+BVHStats Mesh::bvhStats() const
+{
+	BVHStats stats = m_BVH.stats(m_MaxTrianglesPerLeaf);
+	stats.memoryBytes += m_TriangleBlocks.capacity() * sizeof(TriangleBlock);
+	return stats;
 }
 
+// The copy keeps the built BVH along with the split method and leaf size it was built with
 std::unique_ptr<Surface> Mesh::clone() const
 {
-	return std::make_unique<Mesh>(std::vector<Vector3f>(m_VertexBuffer), std::vector<Vector3i>(m_IndexBuffer), m_Material);
+	return std::make_unique<Mesh>(*this);
 }
 
 void Mesh::setMaxTrianglesPerLeaf(unsigned maxTriangles)
@@ -103,12 +349,51 @@ void Mesh::setMaxTrianglesPerLeaf(unsigned maxTriangles)
 
 void Mesh::setMaxTreeDepth(unsigned depth)
 {
+	assert(depth < BVH::s_MaxDepth);
 	s_MaxTreeDepth = depth;
 }
 
+void Mesh::setSplitMethod(SplitMethod method)
+{
+	s_SplitMethod = method;
+}
+
+void Mesh::rebuildBVH(SplitMethod method)
+{
+	m_SplitMethod = method;
+	constructBVH();
+}
+
+void Mesh::setRebuildThreshold(float threshold)
+{
+	assert(threshold >= 1.0f);
+	s_RebuildThreshold = threshold;
+}
+
+void Mesh::setSpatialSplitBudget(float budget)
+{
+	assert(budget >= 0.0f);
+	s_SpatialSplitBudget = budget;
+}
+
+void Mesh::setMailboxing(bool enabled)
+{
+	s_Mailboxing = enabled;
+}
+
+void Mesh::setNodeCompression(bool enabled)
+{
+	s_CompressNodes = enabled;
+}
+
+void Mesh::setCacheDirectory(const std::string& directory)
+{
+	s_CacheDirectory = directory;
+}
+
 void Mesh::calculateVertexNormals()
 {
-	m_VertexNormals.resize(m_VertexBuffer.size());
+	m_VertexNormals.assign(m_VertexBuffer.size(), Vector3f());
 
 	for (Vector3i indexes : m_IndexBuffer)
 	{
@@ -125,50 +410,151 @@ void Mesh::calculateVertexNormals()
 		normal.normalize();
 }
 
-bool Mesh::rayTriangleIntersection(const Vector3i& triangle, const Ray& ray, Context& context, float minT, float maxT, bool culling) const
+// Mller-Trumbore on four triangles at once, every operation is done in the
+// same order as the scalar algorithm so both produce the same results.
+// Read up on the Mller-Trumbore algorithm for a better understanding
+int Mesh::intersectTriangleBlock(const TriangleBlock& block, const BVH::SIMDRay& ray, float minT, float maxT, bool culling, float t[BVH::s_Width], float u[BVH::s_Width], float v[BVH::s_Width])
 {
-	const Point3f& v0 = m_VertexBuffer[triangle[0]];
-	const Point3f& v1 = m_VertexBuffer[triangle[1]];
-	const Point3f& v2 = m_VertexBuffer[triangle[2]];
+	constexpr float deltaEpsilon = 1.0e-7f; // 0.0000001;
+	constexpr float lowerBound = 0.0f - deltaEpsilon;
+	constexpr float upperBound = 1.0f + deltaEpsilon;
 
-	const Vector3f edge0 = v1 - v0;
-	const Vector3f edge1 = v2 - v0;
+	const __m128 e0x = _mm_loadu_ps(block.edge0[0]);
+	const __m128 e0y = _mm_loadu_ps(block.edge0[1]);
+	const __m128 e0z = _mm_loadu_ps(block.edge0[2]);
+	const __m128 e1x = _mm_loadu_ps(block.edge1[0]);
+	const __m128 e1y = _mm_loadu_ps(block.edge1[1]);
+	const __m128 e1z = _mm_loadu_ps(block.edge1[2]);
 
-	const Vector3f normal = toUnitVector(crossProduct(edge0, edge1));
+	const __m128& dx = ray.direction[0];
+	const __m128& dy = ray.direction[1];
+	const __m128& dz = ray.direction[2];
 
-	// Read up on the Mller-Trumbore algorithm for a better understanding
-	const Vector3f dVec = crossProduct(ray.direction(), edge1);
-	const float det = dotProduct(dVec, edge0);
-	constexpr float deltaEpsilon = 1.0e-7f; // 0.0000001;
+	// dVec = direction x edge1
+	const __m128 dVx = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+	const __m128 dVy = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+	const __m128 dVz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
 
-	if (culling && dotProduct(ray.direction(), normal) > 0.0f)
-		return false;
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dVx, e0x), _mm_mul_ps(dVy, e0y)), _mm_mul_ps(dVz, e0z));
+	const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 mask = _mm_cmpge_ps(absDet, _mm_set1_ps(deltaEpsilon));
 
-	if (fabsf(det) < deltaEpsilon)
-		return false;
+	// A positive determinant means the ray faces the front of the triangle
+	if (culling)
+		mask = _mm_and_ps(mask, _mm_cmpgt_ps(det, _mm_setzero_ps()));
+
+	if (_mm_movemask_ps(mask) == 0)
+		return 0;
 
-	const float invDet = 1.0f / det;
+	const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
 
-	const Vector3f oVec = ray.origin() - v0;
-	const float u = dotProduct(dVec, oVec) * invDet;
+	// oVec = origin - v0
+	const __m128 oVx = _mm_sub_ps(ray.origin[0], _mm_loadu_ps(block.v0[0]));
+	const __m128 oVy = _mm_sub_ps(ray.origin[1], _mm_loadu_ps(block.v0[1]));
+	const __m128 oVz = _mm_sub_ps(ray.origin[2], _mm_loadu_ps(block.v0[2]));
 
+	const __m128 uValue = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dVx, oVx), _mm_mul_ps(dVy, oVy)), _mm_mul_ps(dVz, oVz)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(uValue, _mm_set1_ps(lowerBound)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(uValue, _mm_set1_ps(upperBound)));
+
+	// eVec = oVec x edge0
+	const __m128 eVx = _mm_sub_ps(_mm_mul_ps(oVy, e0z), _mm_mul_ps(oVz, e0y));
+	const __m128 eVy = _mm_sub_ps(_mm_mul_ps(oVz, e0x), _mm_mul_ps(oVx, e0z));
+	const __m128 eVz = _mm_sub_ps(_mm_mul_ps(oVx, e0y), _mm_mul_ps(oVy, e0x));
+
+	const __m128 vValue = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(eVx, dx), _mm_mul_ps(eVy, dy)), _mm_mul_ps(eVz, dz)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(vValue, _mm_set1_ps(lowerBound)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(vValue, uValue), _mm_set1_ps(upperBound)));
+
+	const __m128 tValue = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(eVx, e1x), _mm_mul_ps(eVy, e1y)), _mm_mul_ps(eVz, e1z)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(tValue, _mm_set1_ps(minT)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(tValue, _mm_set1_ps(maxT)));
+
+	_mm_storeu_ps(t, tValue);
+	_mm_storeu_ps(u, uValue);
+	_mm_storeu_ps(v, vValue);
+
+	return _mm_movemask_ps(mask);
+}
+
+// The same test as intersectTriangleBlock with the roles swapped, one
+// triangle against the four rays of a packet. Operations are done in the
+// same order, so a packet finds exactly the hits of its single rays.
+int Mesh::intersectTrianglePacket(const TriangleBlock& block, int lane, const RayPacket& packet, float minT, const float maxT[RayPacket::s_Size], bool culling, float t[RayPacket::s_Size], float u[RayPacket::s_Size], float v[RayPacket::s_Size])
+{
+	constexpr float deltaEpsilon = 1.0e-7f; // 0.0000001;
 	constexpr float lowerBound = 0.0f - deltaEpsilon;
 	constexpr float upperBound = 1.0f + deltaEpsilon;
 
-	// 0 >= u, v <= 1; u + v <= 1
-	if (u < lowerBound || u > upperBound)
-		return false;
+	const __m128 e0x = _mm_set1_ps(block.edge0[0][lane]);
+	const __m128 e0y = _mm_set1_ps(block.edge0[1][lane]);
+	const __m128 e0z = _mm_set1_ps(block.edge0[2][lane]);
+	const __m128 e1x = _mm_set1_ps(block.edge1[0][lane]);
+	const __m128 e1y = _mm_set1_ps(block.edge1[1][lane]);
+	const __m128 e1z = _mm_set1_ps(block.edge1[2][lane]);
 
-	const Vector3f eVec = crossProduct(oVec, edge0);
-	const float v = dotProduct(eVec, ray.direction()) * invDet;
+	const __m128& dx = packet.direction[0];
+	const __m128& dy = packet.direction[1];
+	const __m128& dz = packet.direction[2];
 
-	if (v < lowerBound || v + u > upperBound)
-		return false;
+	// dVec = direction x edge1
+	const __m128 dVx = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+	const __m128 dVy = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+	const __m128 dVz = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
 
-	const float t = dotProduct(eVec, edge1) * invDet;
+	const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dVx, e0x), _mm_mul_ps(dVy, e0y)), _mm_mul_ps(dVz, e0z));
+	const __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 mask = _mm_cmpge_ps(absDet, _mm_set1_ps(deltaEpsilon));
 
-	if (t < minT || t > maxT)
-		return false;
+	if (culling)
+		mask = _mm_and_ps(mask, _mm_cmpgt_ps(det, _mm_setzero_ps()));
+
+	if (_mm_movemask_ps(mask) == 0)
+		return 0;
+
+	const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	// oVec = origin - v0
+	const __m128 oVx = _mm_sub_ps(packet.origin[0], _mm_set1_ps(block.v0[0][lane]));
+	const __m128 oVy = _mm_sub_ps(packet.origin[1], _mm_set1_ps(block.v0[1][lane]));
+	const __m128 oVz = _mm_sub_ps(packet.origin[2], _mm_set1_ps(block.v0[2][lane]));
+
+	const __m128 uValue = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dVx, oVx), _mm_mul_ps(dVy, oVy)), _mm_mul_ps(dVz, oVz)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(uValue, _mm_set1_ps(lowerBound)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(uValue, _mm_set1_ps(upperBound)));
+
+	// eVec = oVec x edge0
+	const __m128 eVx = _mm_sub_ps(_mm_mul_ps(oVy, e0z), _mm_mul_ps(oVz, e0y));
+	const __m128 eVy = _mm_sub_ps(_mm_mul_ps(oVz, e0x), _mm_mul_ps(oVx, e0z));
+	const __m128 eVz = _mm_sub_ps(_mm_mul_ps(oVx, e0y), _mm_mul_ps(oVy, e0x));
+
+	const __m128 vValue = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(eVx, dx), _mm_mul_ps(eVy, dy)), _mm_mul_ps(eVz, dz)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(vValue, _mm_set1_ps(lowerBound)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(vValue, uValue), _mm_set1_ps(upperBound)));
+
+	const __m128 tValue = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(eVx, e1x), _mm_mul_ps(eVy, e1y)), _mm_mul_ps(eVz, e1z)), invDet);
+	mask = _mm_and_ps(mask, _mm_cmpge_ps(tValue, _mm_set1_ps(minT)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(tValue, _mm_loadu_ps(maxT)));
+
+	_mm_storeu_ps(t, tValue);
+	_mm_storeu_ps(u, uValue);
+	_mm_storeu_ps(v, vValue);
+
+	return _mm_movemask_ps(mask);
+}
+
+void Mesh::computeContext(const Ray& ray, const Hit& hit, Context& context) const
+{
+	const Vector3i& triangle = m_IndexBuffer[hit.primitive];
+	const float t = hit.distance;
+	const float u = hit.barycentrics.x();
+	const float v = hit.barycentrics.y();
+
+	const Point3f& v0 = m_VertexBuffer[triangle[0]];
+	const Point3f& v1 = m_VertexBuffer[triangle[1]];
+	const Point3f& v2 = m_VertexBuffer[triangle[2]];
+
+	const Vector3f normal = toUnitVector(crossProduct(v1 - v0, v2 - v0));
 
 	context.distance = t;
 	context.uv = Point2f(u, v);
@@ -199,8 +585,6 @@ bool Mesh::rayTriangleIntersection(const Vector3i& triangle, const Ray& ray, Con
 	context.hitPoint = hitPoint;
 	context.normal = toUnitVector(vN1 * u + vN2 * v + vN0 * w); // Smooth normal
 	context.smoothHitPoint = hitPoint + u * tmpu + v * tmpv + w * tmpw;
-
-	return true;
 }
 
 void Mesh::constructAABB()
@@ -222,36 +606,252 @@ void Mesh::constructAABB()
 
 void Mesh::constructBVH()
 {
-	std::vector<AABB> triangleAABBs;
-	triangleAABBs.reserve(m_IndexBuffer.size());
+	const std::vector<AABB> triangleAABBs = constructTriangleAABBs();
+
+	if (m_SplitMethod == SplitMethod::LBVH || m_SplitMethod == SplitMethod::SBVH)
+	{
+		if (m_SplitMethod == SplitMethod::LBVH)
+			m_BVH.buildLinear(triangleAABBs, m_MaxTrianglesPerLeaf, s_MaxTreeDepth);
+		else
+			constructSpatialBVH(triangleAABBs);
+
+		if (s_CompressNodes)
+			m_BVH.quantize();
+
+		m_BuildCost = m_BVH.sahCost();
+		constructTriangleBlocks();
+		return;
+	}
+
 	std::vector<int> triangleIndexBuffer(m_IndexBuffer.size());
 
 	for (int i = 0; i < m_IndexBuffer.size(); i++)
-	{
 		triangleIndexBuffer[i] = i;
-		triangleAABBs.push_back(constructTriangleAABB(m_IndexBuffer[i]));
+
+	SplitInfo rootSplit{ m_AABB, std::move(triangleIndexBuffer) };
+	BVHBuildTree buildTree;
+
+	TaskGroup tasks;
+	BuildContext context(triangleAABBs, tasks);
+	buildNode(context, buildTree, rootSplit, 0);
+	tasks.wait();
+
+	for (std::unique_ptr<BVHBuildTree>& subtree : context.subtrees)
+		subtree->transferAllocatedBlocks(buildTree);
+
+	m_BVH.build(buildTree.root());
+	if (s_CompressNodes)
+		m_BVH.quantize();
+
+	m_BuildCost = m_BVH.sahCost();
+	constructTriangleBlocks();
+}
+
+namespace
+{
+	// Bumped whenever the layout of the cached data changes
+	constexpr uint32_t s_CacheVersion = 2;
+
+	// A cache file is this header followed by the nodes, triangle blocks,
+	// BVH primitives and vertex normals, each stored as a plain array
+	struct CacheHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint64_t key;
+		uint32_t quantized;
+		uint32_t nodeSize;
+		uint64_t nodeCount;
+		uint64_t blockCount;
+		uint64_t primitiveCount;
+		uint64_t normalCount;
+		float buildCost;
+		uint32_t padding;
+	};
+
+	const char s_CacheMagic[4] = { 'I', 'B', 'V', 'H' };
+}
+
+// Normals and the BVH are read from the cache when a file built from the same
+// geometry with the same parameters exists, and written there otherwise
+void Mesh::constructCachedBVH()
+{
+	if (s_CacheDirectory.empty())
+	{
+		calculateVertexNormals();
+		constructBVH();
+		return;
 	}
 
-	constexpr unsigned concurrencyDepth = 6;
-	constexpr unsigned powerOfTwo = constexprPow(2, 6);
+	const uint64_t key = cacheKey();
+
+	char fileName[32];
+	snprintf(fileName, sizeof(fileName), "%016llx.bvh", static_cast<unsigned long long>(key));
+	const std::string cachePath = s_CacheDirectory + "/" + fileName;
+
+	if (loadCachedBVH(cachePath, key))
+		return;
+
+	calculateVertexNormals();
+	constructBVH();
+	storeCachedBVH(cachePath, key);
+}
+
+uint64_t Mesh::cacheKey() const
+{
+	const uint32_t layout[] = { s_CacheVersion, sizeof(BVH::WideNode), sizeof(BVH::QuantizedNode), sizeof(TriangleBlock), static_cast<uint32_t>(m_SplitMethod), m_MaxTrianglesPerLeaf, s_MaxTreeDepth, s_CompressNodes };
+
+	uint64_t key = hashBytes(layout, sizeof(layout));
+	key = hashBytes(&s_SpatialSplitBudget, sizeof(s_SpatialSplitBudget), key);
+	key = hashBytes(m_VertexBuffer.data(), m_VertexBuffer.size() * sizeof(Point3f), key);
+	key = hashBytes(m_IndexBuffer.data(), m_IndexBuffer.size() * sizeof(Vector3i), key);
+
+	return key;
+}
+
+bool Mesh::loadCachedBVH(const std::string& cachePath, uint64_t key)
+{
+	const MappedFile file(cachePath);
+	if (!file.isOpen() || file.size() < sizeof(CacheHeader))
+		return false;
 
-	WorkerInfo workerInfo;
-	workerInfo.depth = concurrencyDepth;
-	workerInfo.workerNodes.reserve(powerOfTwo);
-	SplitInfo boxInfo{ m_AABB, triangleIndexBuffer };
+	CacheHeader header;
+	std::memcpy(&header, file.data(), sizeof(header));
+
+	if (std::memcmp(header.magic, s_CacheMagic, sizeof(s_CacheMagic)) != 0 || header.version != s_CacheVersion || header.key != key)
+		return false;
+
+	const size_t nodeSize = header.quantized ? sizeof(BVH::QuantizedNode) : sizeof(BVH::WideNode);
+	const size_t expectedSize = sizeof(CacheHeader)
+		+ header.nodeCount * nodeSize
+		+ header.blockCount * sizeof(TriangleBlock)
+		+ header.primitiveCount * sizeof(int)
+		+ header.normalCount * sizeof(Vector3f);
+
+	if (header.nodeSize != nodeSize || file.size() != expectedSize || header.normalCount != m_VertexBuffer.size() || header.primitiveCount != header.blockCount * BVH::s_Width)
+		return false;
 
-	m_BVH.clear();
+	const char* data = file.data() + sizeof(CacheHeader);
+	const char* nodes = data;
+	data += header.nodeCount * nodeSize;
+	const TriangleBlock* blocks = reinterpret_cast<const TriangleBlock*>(data);
+	data += header.blockCount * sizeof(TriangleBlock);
+	const int* primitives = reinterpret_cast<const int*>(data);
+	data += header.primitiveCount * sizeof(int);
+	const Vector3f* normals = reinterpret_cast<const Vector3f*>(data);
 
-	TreeBuilder builder(this, &workerInfo.workerNodes, &triangleAABBs, m_MaxTrianglesPerLeaf, concurrencyDepth);
-	builder.buildTree(boxInfo, m_BVH, &workerInfo);
+	if (header.quantized)
+		m_BVH.assign(reinterpret_cast<const BVH::QuantizedNode*>(nodes), header.nodeCount, primitives, header.primitiveCount);
+	else
+		m_BVH.assign(reinterpret_cast<const BVH::WideNode*>(nodes), header.nodeCount, primitives, header.primitiveCount);
+
+	m_TriangleBlocks.assign(blocks, blocks + header.blockCount);
+	m_VertexNormals.assign(normals, normals + header.normalCount);
+	m_BuildCost = header.buildCost;
+
+	return true;
+}
+
+// Written to a temporary file that is renamed once complete, so an interrupted
+// write never leaves a truncated file behind. Failing to write is not an error,
+// the mesh is simply built again next time.
+void Mesh::storeCachedBVH(const std::string& cachePath, uint64_t key) const
+{
+	const std::string temporaryPath = cachePath + ".tmp";
 
-	if (workerInfo.workerNodes.empty())
+	{
+		std::ofstream file(temporaryPath, std::ios::binary);
+		if (!file)
+			return;
+
+		CacheHeader header{};
+		std::memcpy(header.magic, s_CacheMagic, sizeof(s_CacheMagic));
+		header.version = s_CacheVersion;
+		header.key = key;
+		header.quantized = m_BVH.quantized();
+		header.nodeSize = header.quantized ? sizeof(BVH::QuantizedNode) : sizeof(BVH::WideNode);
+		header.nodeCount = header.quantized ? m_BVH.quantizedNodes().size() : m_BVH.nodes().size();
+		header.blockCount = m_TriangleBlocks.size();
+		header.primitiveCount = m_BVH.primitives().size();
+		header.normalCount = m_VertexNormals.size();
+		header.buildCost = m_BuildCost;
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		if (header.quantized)
+			file.write(reinterpret_cast<const char*>(m_BVH.quantizedNodes().data()), header.nodeCount * header.nodeSize);
+		else
+			file.write(reinterpret_cast<const char*>(m_BVH.nodes().data()), header.nodeCount * header.nodeSize);
+		file.write(reinterpret_cast<const char*>(m_TriangleBlocks.data()), header.blockCount * sizeof(TriangleBlock));
+		file.write(reinterpret_cast<const char*>(m_BVH.primitives().data()), header.primitiveCount * sizeof(int));
+		file.write(reinterpret_cast<const char*>(m_VertexNormals.data()), header.normalCount * sizeof(Vector3f));
+
+		if (!file)
+		{
+			file.close();
+			std::remove(temporaryPath.c_str());
+			return;
+		}
+	}
+
+	std::remove(cachePath.c_str());
+	if (std::rename(temporaryPath.c_str(), cachePath.c_str()) != 0)
+		std::remove(temporaryPath.c_str());
+}
+
+// Keeps the topology of the current BVH and only updates its bounds. Moving
+// vertices apart loosens the boxes, once the tree's SAH cost grows past the
+// rebuild threshold compared to the last build it is built from scratch.
+void Mesh::refitBVH()
+{
+	m_BVH.refit(constructTriangleAABBs());
+
+	if (m_BVH.sahCost() > m_BuildCost * s_RebuildThreshold)
+	{
+		constructBVH();
 		return;
+	}
+
+	constructTriangleBlocks();
+}
+
+void Mesh::constructTriangleBlocks()
+{
+	const std::vector<int>& primitives = m_BVH.primitives();
+	m_TriangleBlocks.assign(primitives.size() / BVH::s_Width, TriangleBlock());
+
+	for (size_t i = 0; i < primitives.size(); i++)
+	{
+		TriangleBlock& block = m_TriangleBlocks[i / BVH::s_Width];
+		const int lane = i % BVH::s_Width;
+
+		block.triangle[lane] = primitives[i];
+		if (primitives[i] < 0)
+			continue;
 
-	builder.startConcurrency();
+		const Vector3i& triangle = m_IndexBuffer[primitives[i]];
+		const Point3f& v0 = m_VertexBuffer[triangle[0]];
+		const Vector3f edge0 = m_VertexBuffer[triangle[1]] - v0;
+		const Vector3f edge1 = m_VertexBuffer[triangle[2]] - v0;
 
-	for (WorkerNode& node : workerInfo.workerNodes)
-		node.bvh->transferAllocatedBlocks(m_BVH);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			block.v0[axis][lane] = v0[axis];
+			block.edge0[axis][lane] = edge0[axis];
+			block.edge1[axis][lane] = edge1[axis];
+		}
+	}
+}
+
+std::vector<AABB> Mesh::constructTriangleAABBs()
+{
+	std::vector<AABB> triangleAABBs(m_IndexBuffer.size());
+
+	parallelFor(m_IndexBuffer.size(), 16384, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+			triangleAABBs[i] = constructTriangleAABB(m_IndexBuffer[i]);
+	});
+
+	return triangleAABBs;
 }
 
 AABB Mesh::constructTriangleAABB(const Vector3i& triangle)
@@ -272,7 +872,15 @@ AABB Mesh::constructTriangleAABB(const Vector3i& triangle)
 	return AABB(min, max);
 }
 
-Mesh::SplitPair Mesh::splitBoundingVolume(const AABB& aabb, const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs, unsigned depth)
+Mesh::SplitPair Mesh::splitBoundingVolume(const AABB& aabb, const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs, unsigned depth) const
+{
+	if (m_SplitMethod == SplitMethod::SpatialMedian)
+		return splitSpatialMedian(aabb, triangleIndexBuffer, triangleAABBs, depth);
+
+	return splitSurfaceAreaHeuristic(triangleIndexBuffer, triangleAABBs);
+}
+
+Mesh::SplitPair Mesh::splitSpatialMedian(const AABB& aabb, const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs, unsigned depth)
 {
 	std::vector<int> leftNodeIndexes;
 	leftNodeIndexes.reserve(triangleIndexBuffer.size());
@@ -297,6 +905,341 @@ Mesh::SplitPair Mesh::splitBoundingVolume(const AABB& aabb, const std::vector<in
 	return SplitPair{ leftSplit, rightSplit };
 }
 
+Mesh::SplitPair Mesh::splitSurfaceAreaHeuristic(const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs)
+{
+	std::vector<int> leftNodeIndexes;
+	std::vector<int> rightNodeIndexes;
+	BVH::partitionSAH(triangleIndexBuffer, triangleAABBs, leftNodeIndexes, rightNodeIndexes);
+
+	AABB leftBox, rightBox;
+	for (int index : leftNodeIndexes)
+		leftBox.combine(triangleAABBs[index]);
+	for (int index : rightNodeIndexes)
+		rightBox.combine(triangleAABBs[index]);
+
+	SplitInfo leftSplit = { leftBox, std::move(leftNodeIndexes) };
+	SplitInfo rightSplit = { rightBox, std::move(rightNodeIndexes) };
+
+	return SplitPair{ leftSplit, rightSplit };
+}
+
+void Mesh::constructSpatialBVH(const std::vector<AABB>& triangleAABBs)
+{
+	std::vector<Reference> references;
+	references.reserve(triangleAABBs.size());
+	for (size_t i = 0; i < triangleAABBs.size(); i++)
+		references.push_back({ static_cast<int>(i), triangleAABBs[i] });
+
+	BVHBuildTree buildTree;
+	TaskGroup tasks;
+
+	const size_t maxReferences = static_cast<size_t>(references.size() * (1.0f + s_SpatialSplitBudget));
+	SpatialBuildContext context(m_AABB.surfaceArea(), maxReferences, references.size(), tasks);
+
+	buildSpatialNode(context, buildTree, references, 0);
+	tasks.wait();
+
+	for (std::unique_ptr<BVHBuildTree>& subtree : context.subtrees)
+		subtree->transferAllocatedBlocks(buildTree);
+
+	m_BVH.build(buildTree.root());
+}
+
+// SBVH (Stich et al.): the best binned object split is compared against the
+// best spatial split, which cuts the node's box into bins and clips every
+// reference to the bins it spans. Spatial splits are only searched when the
+// object split's children overlap noticeably and while the reference budget
+// lasts. Straddling references are clipped into both children, so child
+// boxes no longer span whole triangles.
+BVHBuildNode* Mesh::buildSpatialNode(SpatialBuildContext& context, BVHBuildTree& tree, std::vector<Reference>& references, unsigned depth) const
+{
+	constexpr int binCount = 16;
+	constexpr size_t minReferencesPerTask = 4096;
+	constexpr float overlapThreshold = 1.0e-5f;
+
+	if (references.empty())
+		return nullptr;
+
+	AABB aabb, centroidBounds;
+	for (const Reference& reference : references)
+	{
+		aabb.combine(reference.aabb);
+		centroidBounds.combine(reference.aabb.centroid());
+	}
+
+	BVHBuildNode* node = tree.createNode(aabb);
+
+	if (references.size() <= m_MaxTrianglesPerLeaf || depth >= s_MaxTreeDepth)
+	{
+		node->value.reserve(references.size());
+		for (const Reference& reference : references)
+			node->value.push_back(reference.triangle);
+		return node;
+	}
+
+	struct ObjectBin
+	{
+		AABB aabb;
+		unsigned count = 0;
+	};
+
+	struct SpatialBin
+	{
+		AABB aabb;
+		unsigned entries = 0;
+		unsigned exits = 0;
+	};
+
+	const auto findObjectBin = [&centroidBounds](const Reference& reference, int axis) {
+		const float extent = centroidBounds.max()[axis] - centroidBounds.min()[axis];
+		const int bin = static_cast<int>(binCount * (reference.aabb.centroid()[axis] - centroidBounds.min()[axis]) / extent);
+		return std::min(bin, binCount - 1);
+	};
+
+	float objectCost = std::numeric_limits<float>::max();
+	int objectAxis = -1;
+	int objectBin = 0;
+	AABB objectLeftBox, objectRightBox;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (centroidBounds.max()[axis] - centroidBounds.min()[axis] <= 0.0f)
+			continue;
+
+		ObjectBin bins[binCount];
+		for (const Reference& reference : references)
+		{
+			ObjectBin& bin = bins[findObjectBin(reference, axis)];
+			bin.aabb.combine(reference.aabb);
+			bin.count++;
+		}
+
+		AABB rightBoxes[binCount - 1];
+		unsigned rightCounts[binCount - 1];
+
+		AABB rightBox;
+		unsigned rightCount = 0;
+		for (int i = binCount - 1; i > 0; i--)
+		{
+			rightBox.combine(bins[i].aabb);
+			rightCount += bins[i].count;
+			rightBoxes[i - 1] = rightBox;
+			rightCounts[i - 1] = rightCount;
+		}
+
+		AABB leftBox;
+		unsigned leftCount = 0;
+		for (int i = 0; i < binCount - 1; i++)
+		{
+			leftBox.combine(bins[i].aabb);
+			leftCount += bins[i].count;
+
+			if (leftCount == 0 || rightCounts[i] == 0)
+				continue;
+
+			const float cost = leftBox.surfaceArea() * leftCount + rightBoxes[i].surfaceArea() * rightCounts[i];
+			if (cost < objectCost)
+			{
+				objectCost = cost;
+				objectAxis = axis;
+				objectBin = i;
+				objectLeftBox = leftBox;
+				objectRightBox = rightBoxes[i];
+			}
+		}
+	}
+
+	float spatialCost = std::numeric_limits<float>::max();
+	int spatialAxis = -1;
+	float spatialPosition = 0.0f;
+
+	const float overlapArea = objectLeftBox.intersection(objectRightBox).surfaceArea();
+	const bool trySpatialSplit = (objectAxis == -1 || overlapArea > overlapThreshold * context.rootArea) && context.referenceCount < context.maxReferences;
+
+	for (int axis = 0; trySpatialSplit && axis < 3; axis++)
+	{
+		const float origin = aabb.min()[axis];
+		const float binWidth = (aabb.max()[axis] - origin) / binCount;
+		if (binWidth <= 0.0f)
+			continue;
+
+		const auto findSpatialBin = [origin, binWidth](float position) {
+			return std::min(std::max(static_cast<int>((position - origin) / binWidth), 0), binCount - 1);
+		};
+
+		SpatialBin bins[binCount];
+		for (const Reference& reference : references)
+		{
+			const int firstBin = findSpatialBin(reference.aabb.min()[axis]);
+			const int lastBin = std::max(findSpatialBin(reference.aabb.max()[axis]), firstBin);
+
+			Reference remainder = reference;
+			for (int i = firstBin; i < lastBin; i++)
+			{
+				Reference left, right;
+				splitReference(remainder, axis, origin + binWidth * (i + 1), left, right);
+				bins[i].aabb.combine(left.aabb.isEmpty() ? AABB() : left.aabb);
+				remainder = right;
+			}
+
+			bins[lastBin].aabb.combine(remainder.aabb.isEmpty() ? AABB() : remainder.aabb);
+			bins[firstBin].entries++;
+			bins[lastBin].exits++;
+		}
+
+		float rightAreas[binCount - 1];
+		unsigned rightCounts[binCount - 1];
+
+		AABB rightBox;
+		unsigned rightCount = 0;
+		for (int i = binCount - 1; i > 0; i--)
+		{
+			rightBox.combine(bins[i].aabb);
+			rightCount += bins[i].exits;
+			rightAreas[i - 1] = rightBox.surfaceArea();
+			rightCounts[i - 1] = rightCount;
+		}
+
+		AABB leftBox;
+		unsigned leftCount = 0;
+		for (int i = 0; i < binCount - 1; i++)
+		{
+			leftBox.combine(bins[i].aabb);
+			leftCount += bins[i].entries;
+
+			if (leftCount == 0 || rightCounts[i] == 0)
+				continue;
+
+			const float cost = leftBox.surfaceArea() * leftCount + rightAreas[i] * rightCounts[i];
+			if (cost < spatialCost)
+			{
+				spatialCost = cost;
+				spatialAxis = axis;
+				spatialPosition = origin + binWidth * (i + 1);
+			}
+		}
+	}
+
+	auto left = std::make_shared<std::vector<Reference>>();
+	auto right = std::make_shared<std::vector<Reference>>();
+
+	if (spatialAxis != -1 && spatialCost < objectCost)
+	{
+		for (const Reference& reference : references)
+		{
+			if (reference.aabb.max()[spatialAxis] <= spatialPosition)
+			{
+				left->push_back(reference);
+			}
+			else if (reference.aabb.min()[spatialAxis] >= spatialPosition)
+			{
+				right->push_back(reference);
+			}
+			else
+			{
+				Reference leftPart, rightPart;
+				splitReference(reference, spatialAxis, spatialPosition, leftPart, rightPart);
+
+				if (!leftPart.aabb.isEmpty())
+					left->push_back(leftPart);
+				if (!rightPart.aabb.isEmpty())
+					right->push_back(rightPart);
+			}
+		}
+
+		if (left->empty() || right->empty())
+		{
+			left->clear();
+			right->clear();
+		}
+		else
+		{
+			context.referenceCount += left->size() + right->size() - references.size();
+		}
+	}
+
+	if (left->empty() && right->empty())
+	{
+		if (objectAxis == -1)
+		{
+			// All centroids coincide, no plane can separate them so the list is halved
+			const size_t middle = references.size() / 2;
+			left->assign(references.begin(), references.begin() + middle);
+			right->assign(references.begin() + middle, references.end());
+		}
+		else
+		{
+			for (const Reference& reference : references)
+			{
+				if (findObjectBin(reference, objectAxis) <= objectBin)
+					left->push_back(reference);
+				else
+					right->push_back(reference);
+			}
+		}
+	}
+
+	std::vector<Reference>().swap(references);
+
+	if (left->size() >= minReferencesPerTask)
+	{
+		BVHBuildTree* subtree;
+		{
+			std::lock_guard<std::mutex> lock(context.subtreesMutex);
+			context.subtrees.emplace_back(std::make_unique<BVHBuildTree>());
+			subtree = context.subtrees.back().get();
+		}
+
+		context.tasks.run([this, &context, subtree, node, left, depth]() {
+			node->left = buildSpatialNode(context, *subtree, *left, depth + 1);
+		});
+	}
+	else
+	{
+		node->left = buildSpatialNode(context, tree, *left, depth + 1);
+	}
+
+	node->right = buildSpatialNode(context, tree, *right, depth + 1);
+
+	return node;
+}
+
+// Splits a reference at an axis aligned plane by walking the triangle's
+// edges, every vertex and every edge crossing of the plane extends the box
+// of the side it lies on. Both boxes are kept inside the reference's box.
+void Mesh::splitReference(const Reference& reference, int axis, float position, Reference& left, Reference& right) const
+{
+	left = { reference.triangle, AABB() };
+	right = { reference.triangle, AABB() };
+
+	const Vector3i& triangle = m_IndexBuffer[reference.triangle];
+
+	for (int i = 0; i < 3; i++)
+	{
+		const Point3f& v0 = m_VertexBuffer[triangle[i]];
+		const Point3f& v1 = m_VertexBuffer[triangle[(i + 1) % 3]];
+		const float p0 = v0[axis];
+		const float p1 = v1[axis];
+
+		if (p0 <= position)
+			left.aabb.combine(v0);
+		if (p0 >= position)
+			right.aabb.combine(v0);
+
+		if ((p0 < position && position < p1) || (p1 < position && position < p0))
+		{
+			Point3f crossing = v0 + (v1 - v0) * ((position - p0) / (p1 - p0));
+			crossing[axis] = position;
+
+			left.aabb.combine(crossing);
+			right.aabb.combine(crossing);
+		}
+	}
+
+	left.aabb = left.aabb.intersection(reference.aabb);
+	right.aabb = right.aabb.intersection(reference.aabb);
+}
+
 void Mesh::loadObj(const char* filePath)
 {
 	std::ifstream inputStream(filePath);
@@ -339,75 +1282,48 @@ void Mesh::loadObj(const char* filePath)
 	inputStream.close();
 }
 
-Mesh::TreeBuilder::TreeBuilder(const Mesh* meshData, std::vector<WorkerNode>* workerNodes, const std::vector<AABB>* triangleAABBs, unsigned maxTrianglesPerLeaf, unsigned startingDepth)
-	: m_NextNode(0), m_WorkerNodes(workerNodes), m_TriangleAABBs(triangleAABBs), m_MaxTrianglesPerLeaf(maxTrianglesPerLeaf), m_StartingDepth(startingDepth)
-{
-}
-
-void Mesh::TreeBuilder::startConcurrency(unsigned threadCount)
+// Subtrees with enough triangles are handed to the thread pool as tasks of
+// their own, idle workers steal them so uneven halves still keep every core
+// busy. Smaller subtrees are built on the current thread, where the task
+// overhead would outweigh the work.
+BVHBuildNode* Mesh::buildNode(BuildContext& context, BVHBuildTree& tree, SplitInfo& split, unsigned depth) const
 {
-	std::vector<std::thread> threadVector;
-	int threads = threadCount != 0 ? threadCount : std::thread::hardware_concurrency();
+	constexpr size_t minTrianglesPerTask = 4096;
 
-	for (int i = 0; i < threads; i++)
-		threadVector.emplace_back(&Mesh::TreeBuilder::assignWorker, this);
-
-	for (std::thread& thread : threadVector)
-		thread.join();
-}
-
-BVHNode* Mesh::TreeBuilder::buildTree(SplitInfo& boxInfo, BVHTree& bvh, WorkerInfo* workerInfo, unsigned depth)
-{
-	const AABB& aabb = boxInfo.aabb;
-	std::vector<int>& triangleIndexBuffer = boxInfo.triangleIndexBuffer;
-
-	if (boxInfo.triangleIndexBuffer.size() == 0)
+	if (split.triangleIndexBuffer.empty())
 		return nullptr;
 
-	BVHNode* root = bvh.createNode(boxInfo.aabb);
-
-	if (boxInfo.triangleIndexBuffer.size() <= m_MaxTrianglesPerLeaf || depth >= s_MaxTreeDepth)
-	{
-		boxInfo.triangleIndexBuffer.shrink_to_fit();
-		root->value = std::move(boxInfo.triangleIndexBuffer);
-		return root;
-	}
+	BVHBuildNode* node = tree.createNode(split.aabb);
 
-	if (workerInfo != nullptr && depth >= workerInfo->depth)
+	if (split.triangleIndexBuffer.size() <= m_MaxTrianglesPerLeaf || depth >= s_MaxTreeDepth)
 	{
-		workerInfo->workerNodes.emplace_back(aabb, root, std::move(triangleIndexBuffer));
-		return root;
+		split.triangleIndexBuffer.shrink_to_fit();
+		node->value = std::move(split.triangleIndexBuffer);
+		return node;
 	}
 
-	SplitPair pair = Mesh::splitBoundingVolume(boxInfo.aabb, boxInfo.triangleIndexBuffer, *m_TriangleAABBs, depth);
-
-	root->left = buildTree(pair.left, bvh, workerInfo, depth + 1);
-	root->right = buildTree(pair.right, bvh, workerInfo, depth + 1);
-
-	return root;
-}
-
-void Mesh::TreeBuilder::assignWorker()
-{
-	size_t workIndex = 0;
+	auto pair = std::make_shared<SplitPair>(splitBoundingVolume(split.aabb, split.triangleIndexBuffer, context.triangleAABBs, depth));
+	std::vector<int>().swap(split.triangleIndexBuffer);
 
-	while (assignWork(workIndex))
-		constructTree(m_WorkerNodes->operator[](workIndex), *m_TriangleAABBs);
-}
+	if (pair->left.triangleIndexBuffer.size() >= minTrianglesPerTask)
+	{
+		BVHBuildTree* subtree;
+		{
+			std::lock_guard<std::mutex> lock(context.subtreesMutex);
+			context.subtrees.emplace_back(std::make_unique<BVHBuildTree>());
+			subtree = context.subtrees.back().get();
+		}
 
-bool Mesh::TreeBuilder::assignWork(size_t& workIndex)
-{
-	std::lock_guard<std::mutex> lock(s_Mutex);
-	workIndex = m_NextNode++;
-	return workIndex < m_WorkerNodes->size();
-}
+		context.tasks.run([this, &context, subtree, node, pair, depth]() {
+			node->left = buildNode(context, *subtree, pair->left, depth + 1);
+		});
+	}
+	else
+	{
+		node->left = buildNode(context, tree, pair->left, depth + 1);
+	}
 
-void Mesh::TreeBuilder::constructTree(WorkerNode& node, const std::vector<AABB>& triangleAABBs)
-{
-	SplitPair pair = Mesh::splitBoundingVolume(node.aabb, node.triangleIndexBuffer, *m_TriangleAABBs, m_StartingDepth);
+	node->right = buildNode(context, tree, pair->right, depth + 1);
 
-	node.root->left = buildTree(pair.left, *node.bvh, nullptr, m_StartingDepth);
-	node.root->right = buildTree(pair.right, *node.bvh, nullptr, m_StartingDepth);
+	return node;
 }
-
-std::mutex Mesh::TreeBuilder::s_Mutex{};
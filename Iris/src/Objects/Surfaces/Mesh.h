@@ -2,97 +2,166 @@
 
 #define MESH_H
 
-#include <atomic>
 #include <mutex>
+#include <string>
+#include <atomic>
 #include <vector>
-#include <Core/BoundaryTree.h>
+#include <Core/BVH.h>
+#include <Core/ThreadPool.h>
 #include <Objects/Surface.h>
 #include <Containers/Matrix4.h>
 
-using BVHNode = Node<std::vector<int>>;
-using BVHTree = BoundaryTree<std::vector<int>>;
-
 class Mesh : public Surface
 {
 	struct SplitInfo;
 	struct SplitPair;
 
+	// Intersection data of the triangles in BVH::primitives() mirrored in
+	// groups of BVH::s_Width, one SIMD lane per triangle. Padding lanes have
+	// zero edges, which makes them fail the determinant test.
+	struct TriangleBlock
+	{
+		float v0[3][BVH::s_Width];
+		float edge0[3][BVH::s_Width];
+		float edge1[3][BVH::s_Width];
+		int triangle[BVH::s_Width];
+	};
+
+public:
+	enum class SplitMethod
+	{
+		SAH,			// Binned surface area heuristic, every triangle is placed in exactly one leaf
+		SpatialMedian,	// Halves the node's box, straddling triangles are referenced by both children
+		LBVH,			// Splits triangles sorted along a Morton curve, builds fastest but traces slower
+		SBVH			// SAH with spatial splits that clip triangles, for long and overlapping triangles
+	};
+
 public:
 	Mesh(const char* objFile, const std::shared_ptr<Material>& material);
 	Mesh(std::vector<Vector3f>&& vertexBuffer, std::vector<Vector3i>&& indexBuffer, const std::shared_ptr<Material>& material);
 
-	virtual bool isHit(const Ray& ray, Context& context, float minT, float maxT) const override;
+	virtual bool intersect(const Ray& ray, Hit& hit, float minT, float maxT) const override;
+	virtual void computeContext(const Ray& ray, const Hit& hit, Context& context) const override;
+	virtual bool isOccluded(const Ray& ray, float minT, float maxT) const override;
+	/// Same as above but culls back faces as given instead of as the mesh's material says,
+	/// for instances that place the mesh with a material of their own
+	bool intersect(const Ray& ray, Hit& hit, float minT, float maxT, bool culling) const;
+	bool isOccluded(const Ray& ray, float minT, float maxT, bool culling) const;
+	virtual int intersectPacket(const RayPacket& packet, int activeMask, Hit hits[RayPacket::s_Size], float minT, float maxT[RayPacket::s_Size]) const override;
 	virtual void applyTransformations() override;
 	virtual std::unique_ptr<Surface> clone() const override;
 
+	/// Replaces the vertex positions while keeping the triangles, the BVH is refitted instead of rebuilt
+	void updateVertices(std::vector<Point3f>&& vertexBuffer);
+
 	void setMaxTrianglesPerLeaf(unsigned maxTriangles);
 	static void setMaxTreeDepth(unsigned depth);
+	/// Method used by meshes created afterwards
+	static void setSplitMethod(SplitMethod method);
+	/// Rebuilds this mesh's BVH with the given method, which is also used by its later rebuilds
+	void rebuildBVH(SplitMethod method);
+	/// Shape and memory of the mesh's BVH, including the triangle data mirrored for traversal
+	BVHStats bvhStats() const;
+	/// How much a refitted BVH's SAH cost may grow over the built one before it is rebuilt
+	static void setRebuildThreshold(float threshold);
+	/// Fraction of extra triangle references spatial splits may create, relative to the triangle count
+	static void setSpatialSplitBudget(float budget);
+	/// Skips repeated tests of duplicated triangles, only used with the SpatialMedian and SBVH builders.
+	/// Off by default, a block of four triangles costs the same to test with or without skipped lanes.
+	static void setMailboxing(bool enabled);
+	/// Directory where built BVHs are stored and looked up, keyed by a hash of the geometry and the
+	/// build parameters. The directory must exist, an empty path disables the cache
+	static void setCacheDirectory(const std::string& directory);
+	/// Stores BVH nodes quantized to 8 bits per plane, halving the node memory at a small cost in traversal
+	static void setNodeCompression(bool enabled);
 
 private:
 	std::vector<Point3f> m_VertexBuffer;
 	std::vector<Vector3i> m_IndexBuffer;
 	std::vector<Vector3f> m_VertexNormals;
-	BVHTree m_BVH;
+	std::vector<TriangleBlock> m_TriangleBlocks;
+	BVH m_BVH;
 
 	static unsigned s_MaxTreeDepth;
+	static SplitMethod s_SplitMethod;
+	static float s_RebuildThreshold;
+	static float s_SpatialSplitBudget;
+	static bool s_Mailboxing;
+	static std::string s_CacheDirectory;
+	static bool s_CompressNodes;
 	unsigned m_MaxTrianglesPerLeaf;
+	SplitMethod m_SplitMethod;
+	float m_BuildCost;
 
 	void calculateVertexNormals();
-	bool rayTriangleIntersection(const Vector3i& triangle, const Ray& ray, Context& context, float minT, float maxT, bool culling) const;
+	bool traverse(const Ray& ray, float minT, float maxT, bool anyHit, bool culling, Hit& hit) const;
+	template<typename Node>
+	bool traverseNodes(const Node* bvhNodes, const Ray& ray, const BVH::StackEntry& start, float minT, float maxT, bool anyHit, bool culling, Hit& hit) const;
+	template<typename Node>
+	int traversePacket(const Node* bvhNodes, const RayPacket& packet, const BVH::PacketStackEntry& start, float minT, float closestT[RayPacket::s_Size], bool culling, Hit hits[RayPacket::s_Size]) const;
+	static int intersectTriangleBlock(const TriangleBlock& block, const BVH::SIMDRay& ray, float minT, float maxT, bool culling, float t[BVH::s_Width], float u[BVH::s_Width], float v[BVH::s_Width]);
+	static int intersectTrianglePacket(const TriangleBlock& block, int lane, const RayPacket& packet, float minT, const float maxT[RayPacket::s_Size], bool culling, float t[RayPacket::s_Size], float u[RayPacket::s_Size], float v[RayPacket::s_Size]);
 
 	void constructAABB();
 	void constructBVH();
+	void constructCachedBVH();
+	uint64_t cacheKey() const;
+	bool loadCachedBVH(const std::string& cachePath, uint64_t key);
+	void storeCachedBVH(const std::string& cachePath, uint64_t key) const;
+	void refitBVH();
+	void constructTriangleBlocks();
+	std::vector<AABB> constructTriangleAABBs();
 	AABB constructTriangleAABB(const Vector3i& triangle);
 
-	static SplitPair splitBoundingVolume(const AABB& aabb, const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs, unsigned depth = 0);
+	SplitPair splitBoundingVolume(const AABB& aabb, const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs, unsigned depth = 0) const;
+	static SplitPair splitSpatialMedian(const AABB& aabb, const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs, unsigned depth);
+	static SplitPair splitSurfaceAreaHeuristic(const std::vector<int>& triangleIndexBuffer, const std::vector<AABB>& triangleAABBs);
 	// Objects' geometry must be triangular
 	// Only vertecies and face elements are supported at this time!
 	void loadObj(const char* filePath);
 
 private:
-	struct WorkerNode;
 	struct SplitInfo { AABB aabb; std::vector<int> triangleIndexBuffer; };
 	struct SplitPair { SplitInfo left; SplitInfo right; };
-	struct WorkerInfo { std::vector<WorkerNode> workerNodes; unsigned depth = 0; };
 
-	struct WorkerNode {
-		WorkerNode()
-			: aabb(Vector3f(), Vector3f()), root(nullptr)
-		{}
+	// Shared by all tasks of one BVH build. Subtrees built by other tasks are
+	// allocated from build trees of their own, which are merged once done.
+	struct BuildContext
+	{
+		BuildContext(const std::vector<AABB>& triangleAABBs, TaskGroup& tasks)
+			: triangleAABBs(triangleAABBs), tasks(tasks) {}
+
+		const std::vector<AABB>& triangleAABBs;
+		TaskGroup& tasks;
+		std::mutex subtreesMutex;
+		std::vector<std::unique_ptr<BVHBuildTree>> subtrees;
+	};
 
-		WorkerNode(const AABB& aabb, BVHNode* root, const std::vector<int>& triangleIndexBuffer)
-			: aabb(aabb), root(root), triangleIndexBuffer(triangleIndexBuffer), bvh(std::make_unique<BVHTree>())
-		{}
+	BVHBuildNode* buildNode(BuildContext& context, BVHBuildTree& tree, SplitInfo& split, unsigned depth) const;
 
+	// A triangle as seen by the spatial split builder, its box may only cover part of the triangle
+	struct Reference
+	{
+		int triangle;
 		AABB aabb;
-		BVHNode* root;
-		std::vector<int> triangleIndexBuffer;
-		std::unique_ptr<BVHTree> bvh;
 	};
 
-	class TreeBuilder
+	struct SpatialBuildContext
 	{
-	public:
-		TreeBuilder(const Mesh* meshData, std::vector<WorkerNode>* workerNodes, const std::vector<AABB>* triangleAABBs, unsigned maxTrianglesPerLeaf, unsigned startingDepth);
-
-		void startConcurrency(unsigned threadCount = 0);
-		BVHNode* buildTree(SplitInfo& boxInfo, BVHTree& bvh, WorkerInfo* workerInfo = nullptr, unsigned depth = 0);
-
-	private:
-		int m_NextNode;
-		unsigned m_StartingDepth;
-		unsigned m_MaxTrianglesPerLeaf;
-
-		const Mesh* m_MeshData;
-		std::vector<WorkerNode>* m_WorkerNodes;
-		const std::vector<AABB>* m_TriangleAABBs;
-
-		static std::mutex s_Mutex;
-
-		void assignWorker();
-		bool assignWork(size_t& workIndex);
-		void constructTree(WorkerNode& node, const std::vector<AABB>& triangleAABBs);
+		SpatialBuildContext(float rootArea, size_t maxReferences, size_t referenceCount, TaskGroup& tasks)
+			: rootArea(rootArea), maxReferences(maxReferences), referenceCount(referenceCount), tasks(tasks) {}
+
+		float rootArea;
+		size_t maxReferences;
+		std::atomic<size_t> referenceCount;
+		TaskGroup& tasks;
+		std::mutex subtreesMutex;
+		std::vector<std::unique_ptr<BVHBuildTree>> subtrees;
 	};
+
+	void constructSpatialBVH(const std::vector<AABB>& triangleAABBs);
+	BVHBuildNode* buildSpatialNode(SpatialBuildContext& context, BVHBuildTree& tree, std::vector<Reference>& references, unsigned depth) const;
+	void splitReference(const Reference& reference, int axis, float position, Reference& left, Reference& right) const;
 };
 
 #endif // !MESH_H
\ No newline at end of file
@@ -18,7 +18,7 @@ Sphere::Sphere(const Point3f& center, float radius, const std::shared_ptr<Materi
 // and s is a scalar which is used to move the direction vector
 // through 3D space. If we can find real solutions for s, then 
 // our ray has intersected the sphere!
-bool Sphere::isHit(const Ray& ray, Context& context, float minT, float maxT) const
+bool Sphere::intersect(const Ray& ray, Hit& hit, float minT, float maxT) const
 {
     float temp;
     if (!m_AABB.isHit(ray, maxT, temp))
@@ -47,10 +47,20 @@ bool Sphere::isHit(const Ray& ray, Context& context, float minT, float maxT) con
             return false;
     }
 
+    hit.distance = t;
+    hit.primitive = 0;
+    hit.surface = this;
+
+    return true;
+}
+
+void Sphere::computeContext(const Ray& ray, const Hit& hit, Context& context) const
+{
+    const float t = hit.distance;
+
     context.distance = t;
     context.hitPoint = ray.at(t);
     context.material = m_Material.get();
-    context.faceNormal = context.hitPoint;
 
     Vector3f normal = (ray.at(t) - m_Position) / m_Radius;
     context.normal = toUnitVector(transpose(m_InverseTransformation3) * normal);
@@ -59,8 +69,6 @@ bool Sphere::isHit(const Ray& ray, Context& context, float minT, float maxT) con
     const float u = 0.5f + atan2f(-normal.x(), -normal.z()) / 2 * PI;
     const float v = 0.5f - asinf(-normal.y()) / PI;
     context.uv = Point2f(u, v);
-
-    return true;
 }
 
 void Sphere::applyTransformations()
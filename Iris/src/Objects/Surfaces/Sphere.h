@@ -10,7 +10,8 @@ class Sphere : public Surface
 {
 public:
 	Sphere(const Point3f& center, float radius, const std::shared_ptr<Material>& material);
-	virtual bool isHit(const Ray& ray, Context& context, float minT, float maxT) const override;
+	virtual bool intersect(const Ray& ray, Hit& hit, float minT, float maxT) const override;
+	virtual void computeContext(const Ray& ray, const Hit& hit, Context& context) const override;
 	virtual void applyTransformations() override;
 	virtual std::unique_ptr<Surface> clone() const override;
 
@@ -2,6 +2,8 @@
 
 #include <Core/Scene.h>
 #include <Core/Renderer.h>
+#include <Core/ThreadPool.h>
+#include <Objects/Surfaces/Mesh.h>
 
 #include <OpenGL/Window.h>
 #include <OpenGL/Shader.h>
@@ -19,6 +21,12 @@ int main()
 	const int cornellSampleCount = 100;
 	const int bigScenesampleCount = 10;
 
+	// The render runs on the pool while this thread drives the window, so the pool gets every hardware thread
+	ThreadPool::setGlobalThreadCount(std::thread::hardware_concurrency());
+
+	// Built BVHs are stored in and reused from this directory, later runs skip rebuilding unchanged meshes
+	Mesh::setCacheDirectory("cache");
+
 	// Note: This scene is in the repo bit it is zipped inside the folder!
 	//Scene scene("scenes\\custom\\big_scene.crtscene");
 	//std::vector<std::string> paths = {
@@ -72,7 +80,9 @@ void renderWithUI(const Scene& scene, unsigned sampleCount, const std::string& o
 	shader.setUniform1i("u_TextureSampler", 0);
 
 	Renderer renderer;
-	std::thread thread([&renderer, &scene, sampleCount]() { renderer.render(scene, sampleCount); });
+	// Runs on the shared pool, this thread is left to the window
+	TaskGroup rendering;
+	rendering.run([&renderer, &scene, sampleCount]() { renderer.render(scene, sampleCount); });
 
 	GL::Texture texture(Image(scene.settings().width, scene.settings().height));
 
@@ -91,6 +101,6 @@ void renderWithUI(const Scene& scene, unsigned sampleCount, const std::string& o
 	Renderer::shouldStop(true);
 	GL::Window::terminate();
 
-	thread.join();
+	rendering.wait();
 	renderer.saveRender(outputPath.c_str());
 }
\ No newline at end of file
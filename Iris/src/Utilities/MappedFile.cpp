@@ -0,0 +1,90 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filePath)
+	: m_File(INVALID_HANDLE_VALUE), m_Mapping(nullptr), m_Data(nullptr), m_Size(0)
+{
+	m_File = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_File == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0)
+		return;
+
+	m_Mapping = CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_Mapping == nullptr)
+		return;
+
+	m_Data = static_cast<const char*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+	if (m_Data != nullptr)
+		m_Size = static_cast<size_t>(size.QuadPart);
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_Data != nullptr)
+		UnmapViewOfFile(m_Data);
+	if (m_Mapping != nullptr)
+		CloseHandle(m_Mapping);
+	if (m_File != INVALID_HANDLE_VALUE)
+		CloseHandle(m_File);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filePath)
+	: m_File(-1), m_Data(nullptr), m_Size(0)
+{
+	m_File = open(filePath.c_str(), O_RDONLY);
+	if (m_File == -1)
+		return;
+
+	struct stat status;
+	if (fstat(m_File, &status) != 0 || status.st_size == 0)
+		return;
+
+	void* data = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, m_File, 0);
+	if (data == MAP_FAILED)
+		return;
+
+	m_Data = static_cast<const char*>(data);
+	m_Size = static_cast<size_t>(status.st_size);
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_Data != nullptr)
+		munmap(const_cast<char*>(m_Data), m_Size);
+	if (m_File != -1)
+		close(m_File);
+}
+
+#endif
+
+bool MappedFile::isOpen() const
+{
+	return m_Data != nullptr;
+}
+
+const char* MappedFile::data() const
+{
+	return m_Data;
+}
+
+size_t MappedFile::size() const
+{
+	return m_Size;
+}
@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE_H
+
+#define MAPPED_FILE_H
+
+#include <string>
+
+// Read only view of a whole file mapped into memory. The mapping is released
+// when the object is destroyed, an unreadable or empty file leaves it closed.
+class MappedFile
+{
+public:
+	MappedFile(const std::string& filePath);
+	~MappedFile();
+
+	MappedFile(const MappedFile& other) = delete;
+	MappedFile& operator=(const MappedFile& other) = delete;
+
+	bool isOpen() const;
+	const char* data() const;
+	size_t size() const;
+
+private:
+#ifdef _WIN32
+	void* m_File;
+	void* m_Mapping;
+#else
+	int m_File;
+#endif
+	const char* m_Data;
+	size_t m_Size;
+};
+
+#endif // !MAPPED_FILE_H
@@ -4,11 +4,25 @@
 
 #include <random>
 #include <cassert>
+#include <cstdint>
 
 const float PI = 3.14159265359f;
 
 inline float fromDegreesToRadians(float degrees) { return (degrees * PI) / 180.0f; }
 
+// 64-bit FNV-1a, pass the previous result as hash to extend it over more data
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
 inline float randomFloat(float min, float max)
 {
 	//thread_local std::mt19937_64 generator(std::random_device{}());